@@ -0,0 +1,119 @@
+#pragma once
+
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "json.hpp"
+#include "nanocube.h"
+#include "nanocube_traversals.h"
+#include "query_plan.h"
+#include "query_result.h"
+
+using json = nlohmann::json;
+
+// Materialized zoom pyramids of hot split queries. A template is a
+// query with a single split clause, say on dimension d, whose other
+// clauses are fixed filters:
+//
+//   {"query": {"0": {"operation": "split", ...}, "1": {...}}, "depth": D}
+//
+// (the split clause's prefix and resolution are ignored; D defaults to
+// the width of d). Its pyramid holds, for every depth 0..D, the
+// summaries of the cells of d the filtered query finds at that depth,
+// as arrays sorted by address. Any split of d down to a depth of at
+// most D, with the same filters, is then answered by slicing a level
+// instead of walking the cube.
+//
+// Inserts must be reported with touch(); refresh() then recomputes
+// only the cells they touched, from the deepest level up, or rebuilds
+// a pyramid whole when that is cheaper. Pyramids are only used at the
+// version of the cube they were refreshed for. answer() is safe to
+// call from several threads, and alongside a refresh.
+template <typename Summary>
+class MaterializedPyramids {
+ public:
+  MaterializedPyramids();
+
+  // returns false, configuring nothing, unless templates is an array of
+  // valid templates for nc. Pyramids are empty until the first refresh.
+  bool configure(const json &templates, const Nanocube<Summary> &nc);
+
+  // records an insert at addresses, one per dimension
+  void touch(const std::vector<int64_t> &addresses);
+
+  // brings every pyramid up to date with nc, which must not change
+  // meanwhile. Pyramids whose inserts weren't all touched are rebuilt.
+  void refresh(const Nanocube<Summary> &nc);
+
+  // fills result, keyed on plan.key_dims, and returns true if a
+  // pyramid at the given version of the cube answers plan
+  bool answer(const QueryPlan &plan, uint64_t version,
+              QueryResult<Summary> &result) const;
+
+  size_t size() const { return templates_.size(); }
+  json stats_json() const;
+
+ private:
+  struct Template {
+    QueryPlan plan;
+    int dim;
+    int depth;
+    int shift; // from the dimension's width to depth
+  };
+
+  struct Level {
+    std::vector<int64_t> addresses; // sorted
+    std::vector<Summary> values;
+  };
+  typedef std::vector<Level> Pyramid; // by depth
+
+  // summaries to store at a level, or to drop when absent
+  struct Update {
+    int64_t address;
+    bool present;
+    Summary value;
+  };
+
+  struct Snapshot {
+    uint64_t version;
+    std::vector<std::shared_ptr<const Pyramid> > pyramids;
+  };
+
+  // the cells of a level of plan at depth, with the template's filters
+  QueryPlan level_plan(const Template &t, int64_t address, int depth,
+                       int resolution) const;
+
+  std::shared_ptr<const Pyramid> build(const Template &t,
+                                       const Nanocube<Summary> &nc) const;
+  std::shared_ptr<const Pyramid> update(const Template &t, const Pyramid &old,
+                                        std::vector<int64_t> &dirty,
+                                        const Nanocube<Summary> &nc) const;
+
+  // level with updates (sorted by address) applied
+  static Level apply(const Level &level, const std::vector<Update> &updates);
+
+  // rebuild instead of updating when more than 1/FULL_REFRESH_FILL of
+  // the deepest cells are dirty
+  static const size_t FULL_REFRESH_FILL = 4;
+
+  std::vector<Template> templates_;
+
+  mutable std::mutex dirty_mutex_;
+  std::vector<std::vector<int64_t> > dirty_; // deepest cells, per template
+  uint64_t touches_;
+
+  std::mutex refresh_mutex_;
+
+  mutable std::mutex snapshot_mutex_;
+  std::shared_ptr<const Snapshot> snapshot_;
+  uint64_t refreshes_, rebuilds_, updated_cells_;
+  mutable uint64_t hits_;
+};
+
+#include "materialized.inc"
@@ -11,6 +11,7 @@
 #include <fstream>
 
 #include "ref_counted_vec.h"
+#include "summary_store.h"
 
 using namespace std;
 
@@ -53,9 +54,13 @@ struct Nanocube {
 
   /****************************************************************************/
   // simple accessors
-  inline int get_summary_index(int node_index, int dim);
+  inline int get_summary_index(int node_index, int dim) const;
   inline NCDimNode get_children(int node_index, int dim);
 
+  // summary table lookups; these work on both live and frozen nanocubes.
+  inline Summary get_summary(int summary_index) const;
+  Summary sum_summaries(const int *summary_indices, size_t n) const;
+
   /****************************************************************************/
   // queries
   Summary ortho_range_query(const vector<pair<int, int> > &region);
@@ -78,6 +83,13 @@ struct Nanocube {
   // NB, this is fairly inefficient at the moment.
   void content_compact();
 
+  // replaces the summary table with a bit-packed, columnar copy
+  // (see summary_store.h) and drops the summary refcounts. Returns
+  // false, leaving the nanocube untouched, if Summary isn't columnar.
+  // NB: after calling freeze(), insert will yield undefined behavior.
+  bool freeze();
+  bool is_frozen() const { return frozen; }
+
   void dump_internals(bool force_print=false);
 
   void report_size() const;
@@ -89,6 +101,12 @@ struct Nanocube {
   int base_root;
   vector<NCDim> dims;
   RefCountedVec<Summary> summaries;
+  FrozenSummaries<Summary> frozen_summaries;
+  bool frozen;
+
+  // number of inserts so far; query results computed at an older
+  // version are stale
+  uint64_t version;
 
   explicit Nanocube(const vector<int> &widths, bool debug=false);
   Nanocube(const Nanocube<Summary> &other);
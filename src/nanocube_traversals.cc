@@ -1,5 +1,6 @@
 #include "nanocube_traversals.h"
 
+#include <atomic>
 #include <stack>
 #include <sstream>
 
@@ -16,6 +17,87 @@ std::ostream& operator<<(std::ostream& os, const QueryNode &n)
   return os;
 }
 
+TraversalScratch &traversal_scratch()
+{
+  static thread_local TraversalScratch scratch;
+  return scratch;
+}
+
+namespace {
+
+struct QueryScratchPool {
+  ~QueryScratchPool() {
+    for (size_t i=0; i<free.size(); ++i) {
+      delete free[i];
+    }
+  }
+  std::vector<QueryScratch *> free;
+};
+
+thread_local QueryScratchPool query_scratch_pool;
+
+};
+
+QueryScratch *acquire_query_scratch()
+{
+  std::vector<QueryScratch *> &free = query_scratch_pool.free;
+  if (free.empty()) {
+    return new QueryScratch();
+  }
+  QueryScratch *result = free.back();
+  free.pop_back();
+  return result;
+}
+
+void release_query_scratch(QueryScratch *scratch)
+{
+  query_scratch_pool.free.push_back(scratch);
+}
+
+bool QueryControl::poll()
+{
+  if (cancelled.load(std::memory_order_relaxed)) {
+    return true;
+  }
+  if (has_deadline && std::chrono::steady_clock::now() >= deadline) {
+    timed_out = true;
+    cancelled = true;
+    return true;
+  }
+  return false;
+}
+
+namespace {
+
+std::atomic<ThreadPool *> shared_query_pool(0);
+
+};
+
+void set_query_pool(ThreadPool *pool)
+{
+  shared_query_pool = pool;
+}
+
+ThreadPool *query_pool()
+{
+  return shared_query_pool.load();
+}
+
+bool is_split_level(const json &j)
+{
+  if (!j.is_object()) {
+    return false;
+  }
+  for (auto it = j.begin(); it != j.end(); ++it) {
+    const string &key = it.key();
+    if (key.empty() ||
+        key.find_first_not_of("0123456789") != string::npos) {
+      return false;
+    }
+  }
+  return true;
+}
+
 bool isQueryValid(const json &q)
 {
   for (auto it = q.begin(); it != q.end(); ++ it) {
@@ -36,6 +118,11 @@ bool isQueryValid(const json &q)
     else if(op_str == "split") op = 1;
     else if(op_str == "range") op = 2;
     else if(op_str == "all") op = 3;
+    else if(op_str == "topk") op = 4;
+    else if(op_str == "bbox") op = 5;
+    else if(op_str == "polygon") op = 6;
+    else if(op_str == "in") op = 7;
+    else if(op_str == "ranges") op = 8;
     else return false;
 
     switch(op) {
@@ -67,6 +154,67 @@ bool isQueryValid(const json &q)
         if ( ! clause["upperBound"]["address"].is_number() ) return false;
         if ( ! clause["upperBound"]["depth"].is_number() ) return false;
         break;
+      case 4:
+        if (clause.count("prefix") != 1) return false;
+        if (clause.count("resolution") != 1) return false;
+        if (clause.count("k") != 1) return false;
+        if (clause["prefix"].count("address") != 1) return false;
+        if (clause["prefix"].count("depth") != 1) return false;
+        if ( ! clause["prefix"]["address"].is_number() ) return false;
+        if ( ! clause["prefix"]["depth"].is_number() ) return false;
+        if ( ! clause["resolution"].is_number() ) return false;
+        if ( ! clause["k"].is_number_integer() ) return false;
+        if (clause["k"] < 1) return false;
+        break;
+      case 5:
+        for (const char *field: {"level", "x0", "y0", "x1", "y1"}) {
+          if (clause.count(field) != 1) return false;
+          if ( ! clause[field].is_number() ) return false;
+        }
+        // levels past 31 don't fit the 64-bit morton codes
+        if (clause["level"] < 0 || clause["level"] > 31) return false;
+        break;
+      case 6:
+        if (clause.count("level") != 1) return false;
+        if (clause.count("points") != 1) return false;
+        if ( ! clause["level"].is_number() ) return false;
+        if (clause["level"] < 0 || clause["level"] > 31) return false;
+        if ( ! clause["points"].is_array() ) return false;
+        for (const json &point : clause["points"]) {
+          if ( ! point.is_array() || point.size() != 2 ) return false;
+          if ( ! point[0].is_number() || ! point[1].is_number() ) return false;
+        }
+        break;
+      case 7:
+        if (clause.count("prefixes") != 1) return false;
+        if ( ! clause["prefixes"].is_array() ) return false;
+        for (const json &prefix : clause["prefixes"]) {
+          if ( ! prefix.is_object() ) return false;
+          if (prefix.count("address") != 1) return false;
+          if (prefix.count("depth") != 1) return false;
+          if ( ! prefix["address"].is_number() ) return false;
+          if ( ! prefix["depth"].is_number() ) return false;
+          // deeper prefixes don't fit the 64-bit shifts of the walks
+          if (prefix["depth"] < 0 || prefix["depth"] > 62) return false;
+        }
+        break;
+      case 8:
+        if (clause.count("intervals") != 1) return false;
+        if ( ! clause["intervals"].is_array() ) return false;
+        for (const json &interval : clause["intervals"]) {
+          if ( ! interval.is_object() ) return false;
+          for (const char *bound: {"lowerBound", "upperBound"}) {
+            if (interval.count(bound) != 1) return false;
+            if ( ! interval[bound].is_object() ) return false;
+            if (interval[bound].count("address") != 1) return false;
+            if (interval[bound].count("depth") != 1) return false;
+            if ( ! interval[bound]["address"].is_number() ) return false;
+            if ( ! interval[bound]["depth"].is_number() ) return false;
+            if (interval[bound]["depth"] < 0 ||
+                interval[bound]["depth"] > 62) return false;
+          }
+        }
+        break;
     }
 
   }
@@ -2,10 +2,20 @@
 
 // Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <queue>
 #include <stack>
 #include <sstream>
 
 #include "nanocube.h"
+#include "summary_traits.h"
+#include "query_plan.h"
+#include "query_result.h"
+#include "quadtree.h"
+#include "thread_pool.h"
 #include "json.hpp"
 
 using namespace std;
@@ -20,7 +30,7 @@ struct QueryNode {
   QueryNode() {};
   QueryNode(const QueryNode &other): index(other.index), depth(other.depth), 
             dim(other.dim), address(other.address) {};
-  QueryNode(int i, int de, int di, int a): 
+  QueryNode(int i, int de, int di, int64_t a): 
     index(i), depth(de), dim(di), address(a) {};
 
   int index, depth, dim;
@@ -29,6 +39,118 @@ struct QueryNode {
 
 std::ostream& operator<<(std::ostream& os, const QueryNode &n);
 
+// a node of a refinement tree together with the address interval it covers
+struct BoundedIndex {
+  BoundedIndex(int64_t l, int64_t r, int64_t a, int i, int d): 
+               left(l), right(r), address(a), index(i), depth(d) {}
+  BoundedIndex(const BoundedIndex &other):
+               left(other.left), right(other.right), address(other.address), 
+               index(other.index), depth(other.depth) {};
+  
+  int64_t left, right;
+  int64_t address;
+  int index, depth;
+};
+
+// a node of a refinement tree together with the prefixes of a PrefixSet
+// below it, [first, last)
+struct PrefixSpan {
+  PrefixSpan(int i, int d, int64_t a, size_t f, size_t l):
+             index(i), depth(d), address(a), first(f), last(l) {}
+
+  int index, depth;
+  int64_t address;
+  size_t first, last;
+};
+
+// a node of a refinement tree, the address interval it covers, and
+// the intervals of a ranges clause it overlaps: entries [first, last) of
+// TraversalScratch::active_intervals, which is used as a stack, so it
+// holds at most one slice per level of the walk
+struct IntervalSpan {
+  IntervalSpan(const BoundedIndex &n, size_t f, size_t l):
+               node(n), first(f), last(l) {}
+
+  BoundedIndex node;
+  size_t first, last;
+};
+
+// Scratch buffers for the traversal functions. There's one per thread,
+// and buffers are cleared rather than freed between calls, so once a
+// thread has warmed up the traversals don't touch the heap.
+struct TraversalScratch {
+  std::vector<BoundedIndex> range_stack;
+  std::vector<QueryNode> split_stack;
+  std::vector<PrefixSpan> prefix_stack;
+  std::vector<IntervalSpan> interval_stack;
+  std::vector<int> active_intervals;
+};
+
+TraversalScratch &traversal_scratch();
+
+// Query-scoped arena for the plan executor: frontier and key buffers.
+// Scratches come from a per-thread free list, so executors nested on a
+// thread each get their own, and a query borrows warmed-up buffers from
+// the previous queries on its thread.
+struct QueryScratch {
+  std::vector<std::vector<QueryNode> > frontiers;
+  std::vector<int> summary_indices;
+  std::vector<int64_t> key;
+  std::vector<int> key_position;
+  std::vector<int> key_offset;
+};
+
+QueryScratch *acquire_query_scratch();
+void release_query_scratch(QueryScratch *scratch);
+
+struct QueryScratchLease {
+  QueryScratchLease(): scratch(acquire_query_scratch()) {}
+  ~QueryScratchLease() { release_query_scratch(scratch); }
+  QueryScratch *operator->() const { return scratch; }
+
+  QueryScratch *scratch;
+
+ private:
+  QueryScratchLease(const QueryScratchLease &);
+  QueryScratchLease &operator=(const QueryScratchLease &);
+};
+
+// Deadline and cancellation of a running query. The traversals poll()
+// it every few thousand nodes, and the executors check stopped() on
+// every visit; once either says so they unwind, leaving a partial
+// result behind. cancel() may be called from any thread.
+struct QueryControl {
+  QueryControl(): cancelled(false), timed_out(false), has_deadline(false) {}
+
+  void set_timeout_ms(int64_t ms) {
+    has_deadline = true;
+    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+  }
+  void cancel() { cancelled = true; }
+
+  // moves the deadline up to t, if it's later than that or unset. Not
+  // safe while a query using the control runs.
+  void cap_deadline(std::chrono::steady_clock::time_point t) {
+    if (!has_deadline || t < deadline) {
+      has_deadline = true;
+      deadline = t;
+    }
+  }
+
+  bool stopped() const { return cancelled.load(std::memory_order_relaxed); }
+
+  // also checks the clock; true once the query should stop
+  bool poll();
+
+  // how many nodes the traversal loops go between polls
+  static const unsigned POLL_INTERVAL = 1024;
+
+  std::atomic<bool> cancelled;
+  std::atomic<bool> timed_out;
+  bool has_deadline;
+  std::chrono::steady_clock::time_point deadline;
+};
+
 // use as the key when merging query result
 struct ResultKey {
   ResultKey() {};
@@ -54,34 +176,316 @@ struct ResultKey {
 // Utility Functions
 ///////////////////////////////////////////////////////////////////////////////
 
-// merge the raw result when possible
-// for 'find' and 'range', the raw result could be an array
-// TODO needs more testing
+// merges an array of query_json results: nested split levels are
+// merged cell by cell, and summaries are added together
 template <typename Summary>
 json merge_query_result(const json &raw);
 
+// whether j is a level of split cells, keyed by decimal addresses,
+// rather than a summary (sketch summaries are json objects too)
+bool is_split_level(const json &j);
+
 bool isQueryValid(const json &q);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Private Query Functions
 ///////////////////////////////////////////////////////////////////////////////
+// nodes below starting_node that cover the leaves from lower_bound, a
+// prefix at lo_depth, to upper_bound, a prefix at up_depth. The last
+// leaf of upper_bound's block only counts with insert_partial_overlap,
+// which makes both bounds inclusive.
 template <typename T> 
 void query_range(const Nanocube<T> &nc, int dim_index, int starting_node,
                  int64_t lower_bound, int64_t upper_bound, 
                  int lo_depth, int up_depth,
                  std::vector<QueryNode> &nodes,
-                 bool insert_partial_overlap = false);
+                 bool insert_partial_overlap = false,
+                 QueryControl *control = 0);
+
+// nodes below starting_node, on a quadtree dimension, that cover the
+// cells (x, y) of the given level with x0 <= x <= x1 and y0 <= y <= y1:
+// the walk takes the largest nodes inside the rectangle whole, and only
+// goes down the nodes its edges cut through. With a level finer than
+// the dimension's leaves, the leaves the edges cut through only count
+// with insert_partial_overlap.
+template <typename T>
+void query_bbox(const Nanocube<T> &nc, int dim_index, int starting_node,
+                int level, int64_t x0, int64_t y0, int64_t x1, int64_t y1,
+                std::vector<QueryNode> &nodes,
+                bool insert_partial_overlap = false,
+                QueryControl *control = 0);
+
+// the union of query_range over several intervals, in one descent: a
+// node inside any of them is taken once, and a node is only split while
+// some interval cuts through it. Each node only checks the intervals
+// its parent overlaps.
+template <typename T>
+void query_ranges(const Nanocube<T> &nc, int dim_index, int starting_node,
+                  const std::vector<Interval> &intervals,
+                  std::vector<QueryNode> &nodes,
+                  bool insert_partial_overlap = false,
+                  QueryControl *control = 0);
+
+// nodes below starting_node at the prefixes of a PrefixSet, found in
+// one descent: prefixes share the walk down to their common ancestor.
+// Prefixes deeper than the dimension's leaves count their whole leaf,
+// once.
+template <typename T>
+void query_prefix_set(const Nanocube<T> &nc, int dim_index, int starting_node,
+                      const PrefixSet &prefixes,
+                      std::vector<QueryNode> &nodes,
+                      QueryControl *control = 0);
 
 template <typename T> 
 void query_find(const Nanocube<T> &nc, int dim_index, int starting_node, 
                 int64_t address, int depth, std::vector<QueryNode> &nodes);
 
+// index of the node at (address, depth) below starting_node, or -1
+template <typename T>
+inline int find_node(const Nanocube<T> &nc, int dim_index, int starting_node,
+                     int64_t address, int depth);
+
+// Point lookups in bulk: out[i] gets the summary of the cell of point
+// i, whose addresses are addresses[i*n_dims .. (i+1)*n_dims), each taken
+// as a prefix of the depth given for its dimension (0 for the whole
+// dimension, as with find); depths has one entry per dimension. The
+// walks of up to LOOKUP_BATCH_WIDTH points are interleaved, one node
+// hop each in turn, and each hop prefetches the node the walk goes to
+// next, so their cache misses overlap instead of each walk waiting out
+// its own.
+template <typename T>
+void lookup_batch(const Nanocube<T> &nc, const std::vector<int> &depths,
+                  const int64_t *addresses, size_t n, T *out);
+
+static const int LOOKUP_BATCH_WIDTH = 16;
+
 template <typename T> 
 void query_split(const Nanocube<T> &nc, int dim_index, int starting_node,
                  int64_t prefix, int depth, int resolution,
-                 std::vector<QueryNode> &nodes);
+                 std::vector<QueryNode> &nodes,
+                 QueryControl *control = 0);
+
+// nodes of dimension dim_index, starting from starting_node, selected by
+// the plan's operation for that dimension. A topk clause selects what
+// the split would; the executors do the pruning.
+template <typename Summary>
+void plan_frontier(const Nanocube<Summary> &nc, const QueryPlan &plan,
+                   int dim_index, int starting_node,
+                   std::vector<QueryNode> &nodes,
+                   QueryControl *control = 0);
+
+// how a plan gets executed. With a pool, the next-dimension evaluations
+// of any frontier of at least parallel_threshold nodes are spread over
+// the pool's workers, each into its own partial result, and the
+// partial results are merged at the end. Smaller frontiers, and the
+// tasks themselves, run single-threaded. With a control, the walk
+// stops early once it's cancelled or past its deadline.
+struct ExecutionOptions {
+  ExecutionOptions(): memoize(false), pool(0), parallel_threshold(1024),
+                      control(0) {}
 
-// given the query( for all dimensions ), recursively get the final results
+  bool memoize;
+  ThreadPool *pool;
+  size_t parallel_threshold;
+  QueryControl *control;
+};
+
+// pool used by NCQuery; null (the default) means single-threaded
+void set_query_pool(ThreadPool *pool);
+ThreadPool *query_pool();
+
+// a cell of an adaptive split (see evaluate_adaptive_split): the cell
+// at address of depth, and its summary
+template <typename Summary>
+struct AdaptiveCell {
+  int64_t address;
+  int depth;
+  Summary summary;
+};
+
+// walks the cube using only the compiled plan, accumulating summaries
+// straight into a QueryResult keyed on the addresses of the plan's
+// key_dims. Frontiers are kept per dimension and reused across the
+// whole walk; all buffers come from a QueryScratch.
+//
+// With memoize set, the sub-result of every shared node (refcount > 1)
+// is evaluated once and reused: a summary when no keyed dimension is
+// left (total_memo), or a QueryResult keyed on the remaining keyed
+// dimensions (result_memo). The sub-result of a node only depends on
+// the plan, so this is always safe. It only pays off when a walk
+// reaches the same node through several paths, though: nanocubes share
+// nodes along single-child chains, and the frontier of a single clause
+// never contains both a node and one of its descendants, so one plain
+// query practically never hits the memo. It is off by default.
+//
+// A plan with a topk clause is run by run_topk instead: the trees of
+// the topk dimension are searched best-first, most promising cell
+// first, the promise of a cell being the rank of its summary in the
+// cube, over all the trees. That summary bounds what the rest of the
+// plan can find under the cell, so the search can stop at the k-th
+// cell whose exact value outranks every remaining bound.
+template <typename Summary>
+struct PlanExecutor {
+  PlanExecutor(const QueryPlan &plan, const Nanocube<Summary> &nc,
+               QueryResult<Summary> &result,
+               const ExecutionOptions &options = ExecutionOptions());
+
+  void run();
+
+  // adds the sub-result of (dim, index) to out, a result keyed on the
+  // keyed dimensions from out_dim onwards
+  void visit(int dim, int index, QueryResult<Summary> &out, int out_dim);
+
+  // adds the sub-result of (dim, index) to sum, when no keyed dimension
+  // is left. Returns whether the walk reached any summary: a cell only
+  // exists if it did, even when its summaries add up to Summary().
+  bool total(int dim, int index, Summary &sum);
+
+  // the walk of a plan whose topk clause is on dimension dim
+  void run_topk(int dim);
+
+  // the walk of an adaptive split of dimension dim, the plan's only
+  // keyed dimension, into cells instead of result
+  void run_adaptive(int dim, double threshold, size_t max_cells,
+                    std::vector<AdaptiveCell<Summary> > &cells);
+
+  // the trees of dimension dim that the plan's clauses for the
+  // dimensions before it reach from (from_dim, index)
+  void topk_roots(int from_dim, int index, int dim, std::vector<int> &roots);
+
+  const QueryResult<Summary> &memoized(int dim, int index);
+  inline bool is_shared(int dim, int index) const;
+
+  // whether the walk should unwind; polls the control's clock every
+  // POLL_INTERVAL calls
+  inline bool stopped();
+
+  // whether the next-dimension evaluations of a frontier of dimension
+  // dim are worth spreading over the pool
+  inline bool fans_out(int dim, size_t frontier_size) const;
+
+  // visit() and total() over the nodes of a frontier, spread over the pool
+  void parallel_visit(int dim, const std::vector<QueryNode> &nodes,
+                      QueryResult<Summary> &out, int out_dim);
+  bool parallel_total(int dim, const std::vector<QueryNode> &nodes,
+                      Summary &sum);
+
+  const QueryPlan &plan;
+  const Nanocube<Summary> &nc;
+  QueryResult<Summary> &result;
+  ExecutionOptions options;
+  bool memoize;
+  unsigned ticks;
+
+  QueryScratchLease scratch;
+  std::vector<int64_t> &key;
+  std::vector<int> &key_position; // per dimension, -1 if not keyed
+  std::vector<int> &key_offset;   // per dimension, # of keyed dims before it
+  std::vector<std::vector<QueryNode> > &frontiers;
+  std::vector<int> &summary_indices;
+
+  // (sum, whether the walk reached a summary)
+  std::vector<std::unordered_map<int, std::pair<Summary, bool> > > total_memo;
+  std::vector<std::unordered_map<int, QueryResult<Summary> > > result_memo;
+};
+
+template <typename Summary>
+void execute_plan(const QueryPlan &plan,
+                  const Nanocube<Summary> &nc,
+                  QueryResult<Summary> &result,
+                  const ExecutionOptions &options = ExecutionOptions());
+
+// Evaluates several plans over one walk of the cube. Plans that agree on
+// the operations of the dimensions walked so far share that walk: the
+// frontier of a dimension is computed once for each group of plans with
+// equal operations on it, and each plan's key is filled in along the
+// way. Once a group is down to a single plan, that plan's own executor
+// finishes the walk from where the group got to. Plans with a topk
+// clause don't share: they run on their own.
+template <typename Summary>
+struct BatchExecutor {
+  // plans and results are parallel; results[i] must be keyed on
+  // plans[i]->key_dims and both must outlive the executor
+  BatchExecutor(const std::vector<const QueryPlan *> &plans,
+                const Nanocube<Summary> &nc,
+                std::vector<QueryResult<Summary> > &results,
+                const ExecutionOptions &options = ExecutionOptions());
+
+  void run();
+
+  // walks (dim, index) for the plans in members, which all agree on the
+  // operations of the dimensions before dim
+  void visit(int dim, int index, const std::vector<int> &members);
+
+  const std::vector<const QueryPlan *> &plans;
+  const Nanocube<Summary> &nc;
+  std::vector<QueryResult<Summary> > &results;
+  QueryControl *control;
+
+  // one per plan; their key buffers hold the plans' keys
+  std::vector<std::unique_ptr<PlanExecutor<Summary> > > executors;
+
+  // per dimension, reused across the walk
+  std::vector<std::vector<QueryNode> > frontiers;
+  std::vector<std::vector<std::vector<int> > > groups;
+};
+
+// Runs many small plans on one thread, interleaved: each plan's walk is
+// a state machine with an explicit stack of nodes to visit, and the
+// executor takes one node hop of each machine in turn, prefetching the
+// nodes it pushes. By the time a machine comes round again its next
+// node is likely in cache, so the walks' memory stalls overlap. Only
+// handles() plans: unkeyed ones made of find, range and all clauses.
+template <typename Summary>
+struct InterleavedExecutor {
+  // plans and results are parallel, as for BatchExecutor
+  InterleavedExecutor(const std::vector<const QueryPlan *> &plans,
+                      const Nanocube<Summary> &nc,
+                      std::vector<QueryResult<Summary> > &results,
+                      const ExecutionOptions &options = ExecutionOptions());
+
+  static bool handles(const QueryPlan &plan);
+
+  void run();
+
+  // a node left to visit: index in dimension dim, at depth, covering
+  // addresses [left, right)
+  struct Frame {
+    int64_t left, right, address;
+    int index, dim, depth;
+  };
+
+  struct Machine {
+    size_t plan;
+    std::vector<Frame> stack;
+    Summary sum;
+    bool found; // whether sum has any summary in it
+  };
+
+  // visits the node on top of m's stack; false once m is done
+  bool step(Machine &m);
+
+  inline void push(Machine &m, int dim, int index, int64_t left,
+                   int64_t right, int64_t address, int depth);
+
+  // how many machines run at once
+  static const int WIDTH = 16;
+
+  const std::vector<const QueryPlan *> &plans;
+  const Nanocube<Summary> &nc;
+  std::vector<QueryResult<Summary> > &results;
+  QueryControl *control;
+};
+
+// the json format of query results: a summary, or one level of nested
+// objects per keyed dimension, keyed by address
+template <typename Summary>
+json query_result_to_json(const QueryResult<Summary> &result);
+
+// the json result of q from node index of dimension dim on (the whole
+// cube when dim is 0), i.e. the cells of the keyed dimensions from dim
+// on. Invalid queries get the empty summary. Below dimension 0 a topk
+// clause splits like a split clause.
 template <typename Summary>
 json query_json(const json &q,
                 const Nanocube<Summary> &nc,
@@ -92,10 +496,130 @@ json query_json(const json &q,
 ///////////////////////////////////////////////////////////////////////////////
 // APIs
 ///////////////////////////////////////////////////////////////////////////////
+
+// compile_query for the dimensions of nc
+template <typename Summary>
+bool compile_query(const json &q,
+                   const Nanocube<Summary> &nc,
+                   QueryPlan &plan,
+                   bool insert_partial_overlap = false);
+
+// compiles q into plan and runs it (on query_pool()) into result, which
+// gets re-keyed for the plan. Returns false if q is invalid. If control
+// stops the walk, result is partial.
+template <typename Summary>
+bool evaluate_query(const json &q,
+                    const Nanocube<Summary> &nc,
+                    QueryPlan &plan,
+                    QueryResult<Summary> &result,
+                    bool insert_partial_overlap = false,
+                    QueryControl *control = 0);
+
+// Progressive evaluation of q, for answers that have to arrive fast
+// rather than exact. q is answered at decreasing coarsenings (see
+// coarsen_plan), starting `step` levels from the coarsest and refining
+// `step` levels at a time, and each level that completes is handed to
+// emit, along with its coarsening and coarsened plan; the last one
+// (coarsening 0) is the exact answer. The first level runs under
+// control's own deadline, if any; the rest must also finish within
+// budget_ms (when positive) of the call, which takes a control of its
+// own when control is null. Stops early when emit returns false or
+// control stops, and returns false if q is invalid.
+//
+// ProgressiveQuery runs the levels one at a time instead, for callers
+// that have to pause in between (to stream them, say).
+template <typename Summary>
+class ProgressiveQuery {
+ public:
+  ProgressiveQuery(const Nanocube<Summary> &nc, int step, int64_t budget_ms,
+                   QueryControl *control);
+
+  // false if q is invalid. The budget runs from here.
+  bool start(const json &q);
+
+  // runs the next level into result. Returns false if control stopped
+  // it, or if the exact level has already been run.
+  bool next(int &coarsening, QueryPlan &level, QueryResult<Summary> &result);
+
+ private:
+  const Nanocube<Summary> &nc_;
+  int step_;
+  int64_t budget_ms_;
+  QueryControl own_control_; // when not given one
+  QueryControl *control_;
+  std::chrono::steady_clock::time_point start_;
+  QueryPlan plan_;
+  int coarsening_; // of the next level; -1 when there's none
+};
+
+template <typename Summary>
+bool evaluate_progressive(
+    const json &q,
+    const Nanocube<Summary> &nc,
+    int step, int64_t budget_ms,
+    QueryControl *control,
+    const std::function<bool(int, const QueryPlan &,
+                             const QueryResult<Summary> &)> &emit);
+
+// insert_partial_overlap applies to the range, ranges and bbox clauses
+// of q (see query_range).
 template <typename Summary>
 json NCQuery(const json &q,
              const Nanocube<Summary> &nc,
              bool insert_partial_overlap = false);
 
+// Dense grid of the map tile (zoom, x, y) of quadtree dimension dim
+// (see quadtree.h). The tile is split tile_levels() levels down, and
+// cells gets the summaries of the side x side cells in row-major
+// order, starting from the north-west corner. The clauses of q for the
+// other dimensions apply as usual; its clause for dim is ignored.
+// Returns false for invalid queries, tiles outside the quadtree, and
+// queries that split another dimension.
+template <typename Summary>
+bool NCTile(const json &q,
+            const Nanocube<Summary> &nc,
+            int dim, int zoom, int64_t x, int64_t y,
+            std::vector<Summary> &cells, int &side,
+            QueryControl *control = 0);
+
+// Adaptive split: q's split clause, which must be its only keyed one,
+// refined only where it pays. A cell stops being refined once the rank
+// (SummaryTraits::rank) of its summary in the whole cube, which bounds
+// what the other clauses let through, falls below threshold, or when
+// refining it would take the split past max_cells cells. Cells are
+// refined a level at a time across the whole split, so the budget goes
+// to coarse levels everywhere before finer ones. cells gets the
+// nonempty cells, at mixed depths down to the split's resolution,
+// ordered by the first address they cover. Returns false for invalid
+// queries and queries with no split clause or another keyed clause.
+template <typename Summary>
+bool evaluate_adaptive_split(const json &q,
+                             const Nanocube<Summary> &nc,
+                             double threshold, size_t max_cells,
+                             std::vector<AdaptiveCell<Summary> > &cells,
+                             QueryControl *control = 0);
+
+// [{"address": a, "depth": d, "value": v}, ...]
+template <typename Summary>
+json adaptive_cells_to_json(const std::vector<AdaptiveCell<Summary> > &cells);
+
+// {"depths": [d0, d1, ...], "points": [[a0, a1, ...], ...]}: the array
+// of the summaries of the points' cells, in order, from lookup_batch.
+// Returns an empty array if the request is malformed.
+template <typename Summary>
+json NCLookupBatch(const json &request,
+                   const Nanocube<Summary> &nc);
+
+// evaluates a json array of queries, and returns the array of their
+// results, in order. Queries the InterleavedExecutor handles run on
+// it; the rest share walks on a BatchExecutor. Invalid queries get the same
+// result NCQuery gives them; anything other than an array gives an
+// empty array.
+template <typename Summary>
+json NCQueryBatch(const json &queries,
+                  const Nanocube<Summary> &nc,
+                  bool insert_partial_overlap = false,
+                  QueryControl *control = 0);
+
 
 #include "nanocube_traversals.inc"
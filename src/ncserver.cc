@@ -3,6 +3,14 @@
 #include <iterator>
 #include <ctime>
 #include <typeinfo>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #include <boost/random.hpp>
 #include <boost/generator_iterator.hpp>
@@ -15,6 +23,11 @@
 
 #include "nanocube.h"
 #include "nanocube_traversals.h"
+#include "thread_pool.h"
+#include "result_cache.h"
+#include "result_encoding.h"
+#include "query_cost.h"
+#include "materialized.h"
 
 using json = nlohmann::json;
 
@@ -26,6 +39,143 @@ static int qtreeLevel = 10;
 static vector<int> schema = {qtreeLevel*2, qtreeLevel*2};
 static Nanocube<int> nc(schema);
 
+// Queries run on a pool of worker threads against the (by then frozen,
+// read-only) cube. Mongoose connections belong to the event loop, so
+// workers never touch them: each finished response is queued in the
+// outbox under the id of its connection, mg_broadcast() wakes the loop,
+// and the loop sends whatever is in the outbox after every poll.
+// Connections that closed in the meantime are gone from live_connections
+// and their responses are dropped.
+//
+// A keep-alive connection may pipeline requests, which can finish in
+// any order, so every request gets the next sequence number of its
+// connection and the loop only sends the parts of the response at the
+// head of the connection's ResponseQueue; later ones wait until it is
+// complete. (Static files are the exception: mongoose serves them
+// right away.)
+//
+// Large results are streamed instead, with chunked transfer encoding:
+// a HEAD part with the status and headers, then CHUNK parts, the last
+// of which is marked. The loop only moves parts into a connection's
+// send buffer while it holds less than SEND_BUFFER_BYTES, and a stream
+// stops producing while more than STREAM_BUFFER_BYTES of its parts wait
+// in between (StreamCredit), so it never holds more than a few chunks
+// in memory however large the result. A stopped stream doesn't hold on
+// to its worker: the rest of it is parked in the StreamCredit, and
+// posted back to the workers once the loop has sent enough.
+static const size_t SEND_BUFFER_BYTES = 1 << 20;
+static const size_t STREAM_BUFFER_BYTES = 1 << 20;
+static const size_t STREAM_CHUNK_BYTES = 64 << 10;
+
+// results with at least this many cells are streamed
+static const size_t STREAM_MIN_CELLS = 4096;
+
+static ThreadPool *workers = 0;
+
+struct StreamCredit {
+  StreamCredit(): queued(0), closed(false) {}
+
+  // worker side: true if the stream may queue another chunk. If it has
+  // to wait, resume is kept, to be posted to the workers once there is
+  // room again, and the worker should return. False for good once the
+  // connection is gone.
+  bool room(const std::function<void()> &resume) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (closed) {
+      return false;
+    }
+    if (queued <= STREAM_BUFFER_BYTES) {
+      return true;
+    }
+    parked = resume;
+    return false;
+  }
+
+  void acquire(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    queued += bytes;
+  }
+
+  // loop side
+  void release(size_t bytes) {
+    std::function<void()> resume;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queued -= bytes;
+      if (queued <= STREAM_BUFFER_BYTES) {
+        resume.swap(parked);
+      }
+    }
+    if (resume) {
+      workers->post(resume);
+    }
+  }
+
+  void close() {
+    std::function<void()> resume;
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    resume.swap(parked);
+  }
+
+  std::mutex mutex;
+  size_t queued;
+  bool closed;
+  std::function<void()> parked;
+};
+
+struct QueryResponse {
+  enum Part { WHOLE, HEAD, CHUNK };
+
+  QueryResponse(): connection_id(0), sequence(0), part(WHOLE), last(false),
+                   status(200), content_type("application/json") {}
+
+  // whole or last part of its response
+  bool completes() const { return part == WHOLE || (part == CHUNK && last); }
+
+  uintptr_t connection_id;
+  uint64_t sequence; // of the request on its connection
+  Part part;
+  bool last; // last CHUNK of a stream
+  int status;
+  std::string content_type;
+  std::string extra_headers; // "Name: value\r\n" lines
+  std::string body;
+  std::shared_ptr<StreamCredit> credit; // streamed parts only
+};
+
+static ResultCache *cache = 0;
+static MaterializedPyramids<int> *materialized = 0;
+
+// deadline of queries whose request has no X-Query-Deadline-Ms
+// header, in milliseconds; 0 means none
+static int64_t default_deadline_ms = 0;
+
+// node statistics for the cost model, and the largest estimated cost
+// (QueryCost::total) a query may have; 0 means no limit
+static NCStats stats;
+static double max_cost = 0;
+static std::mutex outbox_mutex;
+static vector<QueryResponse> outbox;
+
+// the responses of a connection that haven't been sent whole yet
+struct ResponseQueue {
+  ResponseQueue(): next(0), head(0) {}
+
+  uint64_t next; // sequence number of the connection's next request
+  uint64_t head; // sequence number of the response being sent
+  // parts waiting for their turn, or for room in the send buffer
+  std::map<uint64_t, std::deque<QueryResponse> > parts;
+};
+
+// only touched by the event loop thread
+static uintptr_t next_connection_id = 0;
+static unordered_map<uintptr_t, struct mg_connection *> live_connections;
+static unordered_map<uintptr_t, ResponseQueue> responses;
+// controls of the queries running for each connection, to cancel them
+// when it closes
+static unordered_map<uintptr_t, vector<std::weak_ptr<QueryControl> > > running;
+
 // convert lat,lon to quad tree address
 int64_t loc2addr(double lat, double lon, int qtreeLevel)
 {
@@ -78,40 +228,693 @@ void buildCubes()
     int64_t d2 = loc2addr(des_lat, des_lon, qtreeLevel);
 
     nc.insert(1, {d1, d2});
+    if (materialized) {
+      materialized->touch({d1, d2});
+    }
 
     if (++i % 10000 == 0) {
       //nc.report_size();
       cout << i << endl;
+      if (materialized) {
+        materialized->refresh(nc);
+      }
     }
   }
+  if (materialized) {
+    materialized->refresh(nc);
+  }
 }
 
-static void handle_query_call(struct mg_connection *c, struct http_message *hm) {
-
-  json q = json::parse(string(hm->body.p, hm->body.len));
-  json result = NCQuery(q, nc);
-
-  /* Send result */
-  std::string msg_content = result.dump();
+static void send_response(struct mg_connection *c, const QueryResponse &r) {
   const std::string sep = "\r\n";
 
+  if (r.part == QueryResponse::CHUNK) {
+    if (r.body.size()) {
+      mg_send_http_chunk(c, r.body.data(), r.body.size());
+    }
+    if (r.last) {
+      mg_send_http_chunk(c, "", 0);
+    }
+    return;
+  }
+
   std::stringstream ss;
-  ss << "HTTP/1.1 200 OK"             << sep
-    << "Content-Type: application/json" << sep
+  ss << "HTTP/1.1 " << r.status
+    << (r.status == 200 ? " OK" :
+        r.status == 504 ? " Gateway Timeout" : " Bad Request")
+    << sep
+    << "Content-Type: " << r.content_type << sep
     << "Access-Control-Allow-Origin: *" << sep
-    << "Content-Length: %d"             << sep << sep
-    << "%s";
+    << r.extra_headers;
+  if (r.part == QueryResponse::HEAD) {
+    ss << "Transfer-Encoding: chunked" << sep << sep;
+  } else {
+    ss << "Content-Length: " << r.body.size() << sep << sep;
+  }
+
+  std::string header = ss.str();
+  mg_send(c, header.data(), header.size());
+  if (r.part == QueryResponse::HEAD) {
+    if (r.body.size()) {
+      mg_send_http_chunk(c, r.body.data(), r.body.size());
+    }
+  } else {
+    mg_send(c, r.body.data(), r.body.size());
+  }
+}
+
+static void wake_event_loop(struct mg_connection *, int, void *) {}
+
+static void bad_request(QueryResponse &r, const std::string &error) {
+  r.status = 400;
+  r.content_type = "application/json";
+  r.extra_headers.clear();
+  r.body = json({{"error", error}}).dump();
+}
 
-  mg_printf(c, ss.str().c_str(), (int) msg_content.size(), msg_content.c_str());
+// the query ran out of time; partial is what it got to, if the
+// endpoint can report it
+static void timed_out(QueryResponse &r, const json &partial = json()) {
+  r.status = 504;
+  r.content_type = "application/json";
+  r.extra_headers.clear();
+  json j;
+  j["error"] = "deadline exceeded";
+  j["partial"] = true;
+  if (!partial.is_null()) {
+    j["partial_result"] = partial;
+  }
+  r.body = j.dump();
+}
+
+// a worker's handle on the response to one request: either send() it
+// whole, or stream() it.
+class Responder: public std::enable_shared_from_this<Responder> {
+ public:
+  Responder(struct mg_mgr *mgr, uintptr_t connection_id, uint64_t sequence,
+            const std::shared_ptr<QueryControl> &control):
+      mgr_(mgr), connection_id_(connection_id), sequence_(sequence),
+      control_(control) {}
+
+  bool streaming() const { return bool(credit_); }
+
+  // deadline and cancellation of the request; pass it to the queries
+  QueryControl *control() const { return control_.get(); }
+
+  void send(QueryResponse &r) {
+    r.part = QueryResponse::WHOLE;
+    post(r);
+  }
+
+  // streams the response: head, with the status and headers, then the
+  // chunks of source, which produce() queues as the client takes them.
+  // source may run on other workers, after the request's compute
+  // returned, so it must own whatever it writes from.
+  void stream(QueryResponse &head, const ChunkSource &source) {
+    credit_ = std::make_shared<StreamCredit>();
+    source_ = source;
+    head.part = QueryResponse::HEAD;
+    head.body.clear();
+    post(head);
+  }
+
+  // queues chunks of the stream for as long as it has room, then parks
+  // the rest of it (see StreamCredit)
+  void produce() {
+    std::shared_ptr<Responder> self = shared_from_this();
+    while (credit_->room([self]() { self->produce(); })) {
+      QueryResponse r;
+      r.part = QueryResponse::CHUNK;
+      try {
+        r.last = !source_(r.body);
+      } catch (const std::exception &) {
+        // the client gets a truncated stream
+        r.body.clear();
+        r.last = true;
+      }
+      credit_->acquire(r.body.size());
+      post(r);
+      if (r.last) {
+        source_ = ChunkSource();
+        return;
+      }
+    }
+  }
+
+ private:
+  void post(QueryResponse &r) {
+    r.connection_id = connection_id_;
+    r.sequence = sequence_;
+    r.credit = credit_;
+    {
+      std::lock_guard<std::mutex> lock(outbox_mutex);
+      outbox.push_back(std::move(r));
+    }
+    char wake = 0;
+    mg_broadcast(mgr_, wake_event_loop, &wake, 1);
+  }
+
+  struct mg_mgr *mgr_;
+  uintptr_t connection_id_;
+  uint64_t sequence_;
+  std::shared_ptr<QueryControl> control_;
+  std::shared_ptr<StreamCredit> credit_;
+  ChunkSource source_;
+};
+
+// runs compute on a worker thread. compute either fills in the response
+// to send whole, or streams it through the Responder. compute may
+// throw (json::parse does on malformed bodies); the client then gets a
+// 400, or a truncated stream if it had already started.
+//
+// The request gets a QueryControl, with the deadline of its
+// X-Query-Deadline-Ms header or the default one, and cancelled when
+// the connection closes. compute should hand it to the queries it runs
+// and check it before caching anything. A request that runs out of
+// time gets a 504, unless compute already put a partial result in one.
+static void respond_async(
+    struct mg_connection *c, struct http_message *hm,
+    const std::function<void(QueryResponse &, Responder &)> &compute) {
+  uintptr_t connection_id = (uintptr_t) c->user_data;
+  struct mg_mgr *mgr = c->mgr;
+
+  std::shared_ptr<QueryControl> control = std::make_shared<QueryControl>();
+  int64_t deadline_ms = default_deadline_ms;
+  struct mg_str *header = mg_get_http_header(hm, "X-Query-Deadline-Ms");
+  if (header) {
+    deadline_ms = atoll(std::string(header->p, header->len).c_str());
+  }
+  if (deadline_ms > 0) {
+    control->set_timeout_ms(deadline_ms);
+  }
+  vector<std::weak_ptr<QueryControl> > &controls = running[connection_id];
+  controls.erase(std::remove_if(controls.begin(), controls.end(),
+                                [](const std::weak_ptr<QueryControl> &w) {
+                                  return w.expired();
+                                }),
+                 controls.end());
+  controls.push_back(control);
+  uint64_t sequence = responses[connection_id].next++;
+
+  workers->post([mgr, connection_id, sequence, control, compute]() {
+    std::shared_ptr<Responder> out =
+        std::make_shared<Responder>(mgr, connection_id, sequence, control);
+    QueryResponse r;
+    try {
+      compute(r, *out);
+    } catch (const std::exception &e) {
+      bad_request(r, e.what());
+    }
+    if (out->streaming()) {
+      out->produce();
+    } else if (control->stopped() && !control->timed_out) {
+      // cancelled: the connection is gone, nobody to answer
+    } else {
+      if (control->timed_out && r.status != 504) {
+        timed_out(r);
+      }
+      out->send(r);
+    }
+  });
+}
+
+static QueryCost estimate(const QueryPlan &plan) {
+  return estimate_cost(plan, stats, query_pool() != 0,
+                       ExecutionOptions().parallel_threshold);
+}
+
+// false, with a 400 in r, if the estimated cost of the queries in q (a
+// query, or an array of them) exceeds max_cost
+static bool within_budget(const json &q, QueryResponse &r) {
+  if (max_cost <= 0) {
+    return true;
+  }
+  double total = 0;
+  for (const json &query : q.is_array() ? q : json::array({q})) {
+    QueryPlan plan;
+    if (compile_query(query, nc, plan)) {
+      total += estimate(plan).total();
+    }
+  }
+  if (total <= max_cost) {
+    return true;
+  }
+  bad_request(r, "estimated cost " + to_string(total) +
+              " exceeds the budget of " + to_string(max_cost));
+  return false;
+}
+
+// /explain: the cost estimate of a query, and how it would be run
+static void handle_explain_call(struct mg_connection *c, struct http_message *hm) {
+  std::string body(hm->body.p, hm->body.len);
+  respond_async(c, hm, [body](QueryResponse &r, Responder &) {
+    json q = json::parse(body);
+    QueryPlan plan;
+    if (!compile_query(q, nc, plan)) {
+      bad_request(r, "invalid query");
+      return;
+    }
+    QueryCost cost = estimate(plan);
+    json j = cost.to_json(plan);
+    j["response"] = cost.result_cells >= STREAM_MIN_CELLS ? "chunked" : "whole";
+    j["within_budget"] = max_cost <= 0 || cost.total() <= max_cost;
+    r.body = j.dump();
+  });
+}
+
+// evaluate_query, except that splits a materialized pyramid matches
+// are sliced out of it instead
+static bool answer_query(const json &q, QueryPlan &plan,
+                         QueryResult<int> &result, QueryControl *control) {
+  if (materialized && compile_query(q, nc, plan) &&
+      materialized->answer(plan, nc.version, result)) {
+    return true;
+  }
+  return evaluate_query(q, nc, plan, result, false, control);
+}
+
+// A batch body is a json array of queries, answered with the array of
+// their results. Plain queries are answered in the binary encoding of
+// result_encoding.h when the client asks for it, with an Accept header
+// naming BINARY_RESULT_CONTENT_TYPE or with ?format=binary. Split
+// queries can also be answered as a tensor (see write_tensor_result)
+// with ?format=tensor, and &layout=dense or &layout=coo to override
+// the choice between the two.
+static void handle_query_call(struct mg_connection *c, struct http_message *hm,
+                              bool batch) {
+  std::string body(hm->body.p, hm->body.len);
+  bool binary = false, tensor = false;
+  TensorLayout layout = TENSOR_AUTO;
+  if (!batch) {
+    struct mg_str *accept = mg_get_http_header(hm, "Accept");
+    char format[16];
+    std::string f;
+    if (mg_get_http_var(&hm->query_string, "format", format, sizeof(format)) > 0) {
+      f = format;
+    }
+    binary = (accept && std::string(accept->p, accept->len).find(
+                  BINARY_RESULT_CONTENT_TYPE) != std::string::npos) ||
+        f == "binary";
+    tensor = !binary && f == "tensor";
+    if (tensor &&
+        mg_get_http_var(&hm->query_string, "layout", format, sizeof(format)) > 0) {
+      f = format;
+      layout = f == "dense" ? TENSOR_DENSE : f == "coo" ? TENSOR_COO : TENSOR_AUTO;
+    }
+  }
+  respond_async(c, hm, [body, batch, binary, tensor, layout](
+      QueryResponse &r, Responder &out) {
+    json q = json::parse(body);
+    std::string key = (batch ? "batch:" : binary ? "binary:" : "") +
+        (tensor ? "tensor" + std::to_string(layout) + ":" : "") +
+        canonical_query(q);
+    if (binary) {
+      r.content_type = BINARY_RESULT_CONTENT_TYPE;
+    }
+    if (cache->get(key, nc.version, r.body)) {
+      return;
+    }
+    if (!within_budget(q, r)) {
+      return;
+    }
+    QueryControl *control = out.control();
+    if (batch) {
+      json answers = NCQueryBatch(q, nc, false, control);
+      if (control->stopped()) {
+        timed_out(r, answers);
+        return;
+      }
+      r.body = answers.dump();
+      cache->put(key, nc.version, r.body);
+      return;
+    }
+    QueryPlan plan;
+    // shared with the stream, which may outlive this call
+    auto result = std::make_shared<QueryResult<int> >();
+    if (!answer_query(q, plan, *result, control)) {
+      // what NCQuery answers to invalid queries
+      r.body = json(0).dump();
+      cache->put(key, nc.version, r.body);
+      return;
+    }
+    if (control->stopped()) {
+      timed_out(r, binary ? json() : query_result_to_json(*result));
+      return;
+    }
+    ChunkSource source;
+    if (binary) {
+      auto writer = std::make_shared<BinaryResultWriter<int> >(
+          *result, plan, nc, STREAM_CHUNK_BYTES);
+      if (!writer->ok()) {
+        bad_request(r, "no binary encoding for this query");
+        return;
+      }
+      source = [result, writer](std::string &chunk) {
+        return writer->next(chunk);
+      };
+    } else if (tensor && result->key_size > 0) {
+      auto writer = std::make_shared<TensorResultWriter<int> >(
+          *result, plan, nc, layout, STREAM_CHUNK_BYTES);
+      if (!writer->ok()) {
+        bad_request(r, "no tensor form for this query");
+        return;
+      }
+      source = [result, writer](std::string &chunk) {
+        return writer->next(chunk);
+      };
+    } else {
+      auto writer = std::make_shared<JsonResultWriter<int> >(
+          *result, STREAM_CHUNK_BYTES);
+      source = [result, writer](std::string &chunk) {
+        return writer->next(chunk);
+      };
+    }
+    if (result->size() >= STREAM_MIN_CELLS) {
+      // too big to cache anyway
+      out.stream(r, source);
+      return;
+    }
+    write_chunks(source, [&r](std::string &chunk) {
+      r.body.append(chunk);
+      return true;
+    });
+    cache->put(key, nc.version, r.body);
+  });
+}
+
+// the next level of progressive, as an ndjson line; false if there was
+// none to run
+static bool next_progressive_line(ProgressiveQuery<int> &progressive,
+                                  std::string &line, bool &exact) {
+  int coarsening;
+  QueryPlan plan;
+  QueryResult<int> result;
+  if (!progressive.next(coarsening, plan, result)) {
+    return false;
+  }
+  json level;
+  level["coarsening"] = coarsening;
+  exact = coarsening == 0;
+  level["exact"] = exact;
+  level["result"] = query_result_to_json(result);
+  line = level.dump() + "\n";
+  return true;
+}
+
+// /progressive_query?budget_ms=B[&step=S]: the query answered coarse
+// first and then refined S levels at a time (default 2, a quadtree
+// zoom level) for as long as B allows, one newline-terminated json
+// object per level: {"coarsening":c,"exact":bool,"result":...}. See
+// evaluate_progressive. The levels aren't cached. With a positive B the
+// time budget stands in for the cost budget; without one the query goes
+// down to the exact level whatever it takes, so it must be within the
+// cost budget like /query. Each level is computed as the stream
+// asks for it, so a slow client also slows the refinement down.
+static void handle_progressive_call(struct mg_connection *c,
+                                    struct http_message *hm) {
+  std::string body(hm->body.p, hm->body.len);
+  char var[32];
+  int64_t budget_ms = 0;
+  int step = 2;
+  if (mg_get_http_var(&hm->query_string, "budget_ms", var, sizeof(var)) > 0) {
+    budget_ms = atoll(var);
+  }
+  if (mg_get_http_var(&hm->query_string, "step", var, sizeof(var)) > 0) {
+    step = atoi(var);
+  }
+  respond_async(c, hm, [body, budget_ms, step](QueryResponse &r, Responder &out) {
+    json q = json::parse(body);
+    if (budget_ms <= 0 && !within_budget(q, r)) {
+      return;
+    }
+    r.content_type = "application/x-ndjson";
+    auto progressive = std::make_shared<ProgressiveQuery<int> >(
+        nc, step, budget_ms, out.control());
+    if (!progressive->start(q)) {
+      bad_request(r, "invalid query");
+      return;
+    }
+    // the first level before the stream starts, so that running out of
+    // time before it still answers 504
+    std::string first;
+    bool exact;
+    if (!next_progressive_line(*progressive, first, exact)) {
+      timed_out(r);
+      return;
+    }
+    out.stream(r, [progressive, first, exact](std::string &chunk) mutable {
+      if (!first.empty()) {
+        chunk.swap(first);
+      } else if (!next_progressive_line(*progressive, chunk, exact)) {
+        // stopped: the stream ends before the exact level
+        return false;
+      }
+      return !exact;
+    });
+  });
+}
+
+// /adaptive_query?threshold=T&max_cells=N: the split of the query,
+// refined only where the cube holds at least T and while it has at most
+// N cells (default ADAPTIVE_MAX_CELLS), as a json array of mixed-depth
+// cells (see evaluate_adaptive_split).
+static const size_t ADAPTIVE_MAX_CELLS = 4096;
+
+static void handle_adaptive_call(struct mg_connection *c, struct http_message *hm) {
+  std::string body(hm->body.p, hm->body.len);
+  char var[32];
+  double threshold = 0;
+  size_t max_cells = ADAPTIVE_MAX_CELLS;
+  if (mg_get_http_var(&hm->query_string, "threshold", var, sizeof(var)) > 0) {
+    threshold = atof(var);
+  }
+  if (mg_get_http_var(&hm->query_string, "max_cells", var, sizeof(var)) > 0) {
+    max_cells = std::max(1L, atol(var));
+  }
+  respond_async(c, hm, [body, threshold, max_cells](QueryResponse &r, Responder &out) {
+    json q = json::parse(body);
+    std::stringstream key;
+    key << "adaptive:" << threshold << ":" << max_cells << ":" << canonical_query(q);
+    if (cache->get(key.str(), nc.version, r.body)) {
+      return;
+    }
+    QueryControl *control = out.control();
+    std::vector<AdaptiveCell<int> > cells;
+    if (!evaluate_adaptive_split(q, nc, threshold, max_cells, cells, control)) {
+      bad_request(r, "invalid query, or not a single split");
+      return;
+    }
+    if (control->stopped()) {
+      timed_out(r);
+      return;
+    }
+    r.body = adaptive_cells_to_json(cells).dump();
+    cache->put(key.str(), nc.version, r.body);
+  });
+}
+
+// /lookup_batch: the summaries of many point cells at once (see
+// NCLookupBatch). Not cached: bodies are one-off lists of points.
+static void handle_lookup_call(struct mg_connection *c, struct http_message *hm) {
+  std::string body(hm->body.p, hm->body.len);
+  respond_async(c, hm, [body](QueryResponse &r, Responder &) {
+    json request = json::parse(body);
+    if (!request.is_object() || request.count("points") != 1) {
+      bad_request(r, "expected {\"depths\": [...], \"points\": [...]}");
+      return;
+    }
+    r.body = NCLookupBatch(request, nc).dump();
+  });
+}
+
+static void respond_now(struct mg_connection *c, QueryResponse &r);
+
+// little-endian int32 per cell
+static std::string encode_tile(const vector<int> &cells) {
+  std::string bytes;
+  bytes.reserve(cells.size() * 4);
+  for (size_t i = 0; i < cells.size(); ++i) {
+    append_le(bytes, (uint32_t) cells[i], 4);
+  }
+  return bytes;
+}
+
+// /tile/z/x/y[?dim=d][&q=...]: the dense grid of a map tile on
+// quadtree dimension d (default 0). Clauses for the other dimensions
+// come from the request body, or from the q variable.
+static void handle_tile_call(struct mg_connection *c, struct http_message *hm) {
+  std::string uri(hm->uri.p, hm->uri.len);
+  int zoom;
+  long long x, y;
+  char rest;
+  if (sscanf(uri.c_str(), "/tile/%d/%lld/%lld%c", &zoom, &x, &y, &rest) != 3) {
+    QueryResponse r;
+    bad_request(r, "expected /tile/z/x/y");
+    respond_now(c, r);
+    return;
+  }
+  char var[4096];
+  int dim = 0;
+  if (mg_get_http_var(&hm->query_string, "dim", var, sizeof(var)) > 0) {
+    dim = atoi(var);
+  }
+  std::string body(hm->body.p, hm->body.len);
+  if (body.empty() &&
+      mg_get_http_var(&hm->query_string, "q", var, sizeof(var)) > 0) {
+    body = var;
+  }
+  respond_async(c, hm, [body, dim, zoom, x, y](QueryResponse &r, Responder &out) {
+    json q = body.empty() ? json::object() : json::parse(body);
+    std::stringstream key;
+    key << "tile:" << dim << "/" << zoom << "/" << x << "/" << y << ":"
+        << canonical_query(q);
+    vector<int> cells;
+    int side;
+    if (!cache->get(key.str(), nc.version, r.body)) {
+      if (!NCTile(q, nc, dim, zoom, x, y, cells, side, out.control())) {
+        bad_request(r, "invalid tile query");
+        return;
+      }
+      if (out.control()->stopped()) {
+        return;
+      }
+      r.body = encode_tile(cells);
+      cache->put(key.str(), nc.version, r.body);
+    }
+    side = 1 << tile_levels(nc.dims[dim].width / 2, zoom);
+    r.content_type = "application/octet-stream";
+    r.extra_headers = "X-Tile-Size: " + to_string(side) + "\r\n";
+  });
+}
+
+// moves the parts of the connection's responses into its send buffer,
+// in request order, as far as there's room
+static void pump(struct mg_connection *c) {
+  auto f = responses.find((uintptr_t) c->user_data);
+  if (f == responses.end()) {
+    return;
+  }
+  ResponseQueue &queue = f->second;
+  while (c->send_mbuf.len < SEND_BUFFER_BYTES) {
+    auto head = queue.parts.find(queue.head);
+    if (head == queue.parts.end() || head->second.empty()) {
+      break;
+    }
+    QueryResponse &r = head->second.front();
+    send_response(c, r);
+    if (r.credit) {
+      r.credit->release(r.body.size());
+    }
+    bool complete = r.completes();
+    head->second.pop_front();
+    if (complete) {
+      queue.parts.erase(head);
+      ++queue.head;
+    }
+  }
+}
+
+// answers a request right away from the loop, in its turn
+static void respond_now(struct mg_connection *c, QueryResponse &r) {
+  r.connection_id = (uintptr_t) c->user_data;
+  ResponseQueue &queue = responses[r.connection_id];
+  r.sequence = queue.next++;
+  r.part = QueryResponse::WHOLE;
+  queue.parts[r.sequence].push_back(std::move(r));
+  pump(c);
+}
+
+// drops whatever is still waiting for a connection that closed
+static void drop_pending(uintptr_t connection_id) {
+  auto f = responses.find(connection_id);
+  if (f == responses.end()) {
+    return;
+  }
+  for (auto p = f->second.parts.begin(); p != f->second.parts.end(); ++p) {
+    for (size_t i = 0; i < p->second.size(); ++i) {
+      if (p->second[i].credit) {
+        p->second[i].credit->close();
+      }
+    }
+  }
+  responses.erase(f);
+}
+
+// takes the parts the workers have produced since the last call
+static void flush_outbox() {
+  vector<QueryResponse> ready;
+  {
+    std::lock_guard<std::mutex> lock(outbox_mutex);
+    ready.swap(outbox);
+  }
+  vector<struct mg_connection *> touched;
+  for (size_t i = 0; i < ready.size(); ++i) {
+    auto f = live_connections.find(ready[i].connection_id);
+    if (f == live_connections.end()) {
+      if (ready[i].credit) {
+        ready[i].credit->close();
+      }
+      continue;
+    }
+    QueryResponse &r = ready[i];
+    responses[r.connection_id].parts[r.sequence].push_back(std::move(r));
+    touched.push_back(f->second);
+  }
+  for (size_t i = 0; i < touched.size(); ++i) {
+    pump(touched[i]);
+  }
 }
 
 static void ev_handler(struct mg_connection *c, int ev, void *ev_data) {
   struct http_message *hm = (struct http_message *) ev_data;
 
   switch (ev) {
+    case MG_EV_ACCEPT:
+      c->user_data = (void *) ++next_connection_id;
+      live_connections[next_connection_id] = c;
+      break;
+    case MG_EV_CLOSE: {
+      uintptr_t connection_id = (uintptr_t) c->user_data;
+      live_connections.erase(connection_id);
+      drop_pending(connection_id);
+      auto f = running.find(connection_id);
+      if (f != running.end()) {
+        for (size_t i = 0; i < f->second.size(); ++i) {
+          std::shared_ptr<QueryControl> control = f->second[i].lock();
+          if (control) {
+            control->cancel();
+          }
+        }
+        running.erase(f);
+      }
+      break;
+    }
+    case MG_EV_SEND:
+      pump(c);
+      break;
     case MG_EV_HTTP_REQUEST:
       if (mg_vcmp(&hm->uri, "/query") == 0) {
-        handle_query_call(c, hm); /* Handle RESTful call */
+        handle_query_call(c, hm, false); /* Handle RESTful call */
+      } else if (mg_vcmp(&hm->uri, "/batch_query") == 0) {
+        handle_query_call(c, hm, true);
+      } else if (mg_vcmp(&hm->uri, "/lookup_batch") == 0) {
+        handle_lookup_call(c, hm);
+      } else if (mg_vcmp(&hm->uri, "/adaptive_query") == 0) {
+        handle_adaptive_call(c, hm);
+      } else if (mg_vcmp(&hm->uri, "/progressive_query") == 0) {
+        handle_progressive_call(c, hm);
+      } else if (hm->uri.len > 6 && strncmp(hm->uri.p, "/tile/", 6) == 0) {
+        handle_tile_call(c, hm);
+      } else if (mg_vcmp(&hm->uri, "/explain") == 0) {
+        handle_explain_call(c, hm);
+      } else if (mg_vcmp(&hm->uri, "/cache_stats") == 0) {
+        QueryResponse r;
+        r.body = cache->stats_json().dump();
+        respond_now(c, r);
+      } else if (mg_vcmp(&hm->uri, "/materialized_stats") == 0) {
+        QueryResponse r;
+        r.body = materialized ? materialized->stats_json().dump() : "null";
+        respond_now(c, r);
       } 
       else {
         mg_serve_http(c, hm, s_http_server_opts); /* Serve static content */
@@ -124,6 +927,32 @@ static void ev_handler(struct mg_connection *c, int ev, void *ev_data) {
 
 int main(int argc, char *argv[]) {
 
+  // --threads N: size of the query worker pool
+  // --cache-mb N: memory budget of the result cache
+  // --max-cost N: reject queries whose estimated cost exceeds N
+  // --deadline-ms N: default query deadline
+  // --materialize FILE: json array of split query templates to keep
+  //   materialized (see materialized.h)
+  int n_threads = std::thread::hardware_concurrency();
+  size_t cache_mb = 64;
+  string materialize_file;
+  for (int i = 1; i < argc; ++i) {
+    if (string(argv[i]) == "--threads" && i+1 < argc) {
+      n_threads = atoi(argv[++i]);
+    } else if (string(argv[i]) == "--cache-mb" && i+1 < argc) {
+      cache_mb = atol(argv[++i]);
+    } else if (string(argv[i]) == "--max-cost" && i+1 < argc) {
+      max_cost = atof(argv[++i]);
+    } else if (string(argv[i]) == "--deadline-ms" && i+1 < argc) {
+      default_deadline_ms = atoll(argv[++i]);
+    } else if (string(argv[i]) == "--materialize" && i+1 < argc) {
+      materialize_file = argv[++i];
+    }
+  }
+  if (n_threads < 1) {
+    n_threads = 1;
+  }
+
   struct mg_mgr mgr;
   struct mg_connection *c;
 
@@ -134,13 +963,44 @@ int main(int argc, char *argv[]) {
   s_http_server_opts.document_root = "./";
   s_http_server_opts.enable_directory_listing = "no";
 
+  // pyramids are refreshed after each batch of inserts
+  MaterializedPyramids<int> pyramids;
+  if (!materialize_file.empty()) {
+    ifstream is(materialize_file.c_str());
+    json templates;
+    try {
+      is >> templates;
+    } catch (const std::exception &) {
+    }
+    if (!pyramids.configure(templates, nc)) {
+      cerr << "Bad materialization templates in " << materialize_file << endl;
+      return 1;
+    }
+    materialized = &pyramids;
+  }
+
   // build Gaussian Cubes
   buildCubes();
 
-  printf("Starting server on port %s\n", s_http_port);
+  // the cube is read-only from here on, so pack its summaries
+  nc.freeze();
+  nc.report_size();
+  stats.collect(nc);
+
+  // large queries also spread their frontiers over the same workers
+  ThreadPool pool(n_threads);
+  workers = &pool;
+  set_query_pool(&pool);
+
+  ResultCache result_cache(cache_mb << 20);
+  cache = &result_cache;
+
+  printf("Starting server on port %s with %d worker threads\n",
+         s_http_port, n_threads);
 
   for (;;) {
     mg_mgr_poll(&mgr, 1000);
+    flush_outbox();
   }
 
 
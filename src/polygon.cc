@@ -0,0 +1,190 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include "polygon.h"
+#include "quadtree.h"
+
+#include <cmath>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+
+namespace {
+
+struct Edge {
+  double x0, y0, x1, y1;
+};
+
+// whether the segment meets the closed box [l, r] x [b, t]
+// (Liang-Barsky clipping)
+bool crosses(const Edge &e, double l, double b, double r, double t)
+{
+  double dx = e.x1 - e.x0, dy = e.y1 - e.y0;
+  double p[4] = {-dx, dx, -dy, dy};
+  double q[4] = {e.x0 - l, r - e.x0, e.y0 - b, t - e.y0};
+  double enter = 0.0, leave = 1.0;
+  for (int i = 0; i < 4; ++i) {
+    if (p[i] == 0.0) {
+      if (q[i] < 0.0) {
+        return false;
+      }
+    } else {
+      double s = q[i] / p[i];
+      if (p[i] < 0.0) {
+        enter = max(enter, s);
+      } else {
+        leave = min(leave, s);
+      }
+    }
+  }
+  return enter <= leave;
+}
+
+// even-odd rule
+bool inside(const vector<Edge> &edges, double x, double y)
+{
+  bool result = false;
+  for (size_t i = 0; i < edges.size(); ++i) {
+    const Edge &e = edges[i];
+    if ((e.y0 > y) != (e.y1 > y) &&
+        x < e.x0 + (y - e.y0) * (e.x1 - e.x0) / (e.y1 - e.y0)) {
+      result = !result;
+    }
+  }
+  return result;
+}
+
+// the rasterization of a polygon down to a level. cuts[z] lists the
+// edges that cut the parent of the cell of level z being covered, so
+// one list per level is all the recursion needs.
+struct CoverWalk {
+  CoverWalk(const vector<Edge> &e, int l, size_t m, PrefixSet &c):
+      edges(e), level(l), max_cells(m), cuts(l + 2), cover(c) {}
+
+  // covers cell (x, y) of level z; false once the cover has more than
+  // max_cells cells
+  bool cell(int z, uint32_t x, uint32_t y)
+  {
+    double size = ldexp(1.0, -z);
+    double l = x * size, b = y * size, r = l + size, t = b + size;
+    const vector<int> &cut = cuts[z];
+    vector<int> &own = cuts[z + 1];
+    own.clear();
+    for (size_t i = 0; i < cut.size(); ++i) {
+      if (crosses(edges[cut[i]], l, b, r, t)) {
+        own.push_back(cut[i]);
+      }
+    }
+    if (own.empty() || z == level) {
+      // wholly inside or outside, or as fine as it gets
+      if (inside(edges, l + size / 2, b + size / 2)) {
+        cover.push_back(make_pair(morton_encode(x, y), 2 * z));
+      }
+      return cover.size() <= max_cells;
+    }
+    // children in z-order: the x bit is the low one
+    for (int q = 0; q < 4; ++q) {
+      if (!cell(z + 1, (x << 1) | (q & 1), (y << 1) | (q >> 1))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const vector<Edge> &edges;
+  int level;
+  size_t max_cells;
+  vector<vector<int> > cuts;
+  PrefixSet &cover;
+};
+
+struct CachedCover {
+  size_t hash;
+  Polygon polygon;
+  int level;
+  shared_ptr<const PrefixSet> cover;
+};
+
+const size_t MAX_CACHED_COVERS = 256;
+
+mutex cover_cache_mutex;
+list<CachedCover> cover_lru; // most recently used first
+unordered_map<size_t, list<CachedCover>::iterator> cover_index;
+
+size_t polygon_hash(const Polygon &polygon, int level)
+{
+  size_t h = hash<int>()(level);
+  for (size_t i = 0; i < polygon.size(); ++i) {
+    h = h * 31 + hash<double>()(polygon[i].first);
+    h = h * 31 + hash<double>()(polygon[i].second);
+  }
+  return h;
+}
+
+};
+
+int polygon_cover(const Polygon &polygon, int level, PrefixSet &cover,
+                  size_t max_cells)
+{
+  cover.clear();
+  level = max(0, min(level, 31));
+  if (polygon.size() < 3) {
+    return level;
+  }
+  vector<Edge> edges;
+  for (size_t i = 0; i < polygon.size(); ++i) {
+    const pair<double, double> &a = polygon[i];
+    const pair<double, double> &b = polygon[(i + 1) % polygon.size()];
+    Edge e;
+    mercator_unit(a.first * M_PI / 180.0, a.second * M_PI / 180.0, e.x0, e.y0);
+    mercator_unit(b.first * M_PI / 180.0, b.second * M_PI / 180.0, e.x1, e.y1);
+    edges.push_back(e);
+  }
+  // the cells along the edges about double with each level, so a
+  // level too fine gives up early
+  for (;; --level) {
+    CoverWalk walk(edges, level, max_cells, cover);
+    for (size_t i = 0; i < edges.size(); ++i) {
+      walk.cuts[0].push_back(i);
+    }
+    cover.clear();
+    if (walk.cell(0, 0, 0) || level == 0) {
+      return level;
+    }
+  }
+}
+
+shared_ptr<const PrefixSet> cached_polygon_cover(const Polygon &polygon,
+                                                 int level)
+{
+  size_t h = polygon_hash(polygon, level);
+  {
+    lock_guard<mutex> lock(cover_cache_mutex);
+    auto f = cover_index.find(h);
+    if (f != cover_index.end() && f->second->level == level &&
+        f->second->polygon == polygon) {
+      cover_lru.splice(cover_lru.begin(), cover_lru, f->second);
+      return f->second->cover;
+    }
+  }
+
+  shared_ptr<PrefixSet> cover = make_shared<PrefixSet>();
+  polygon_cover(polygon, level, *cover);
+
+  lock_guard<mutex> lock(cover_cache_mutex);
+  auto f = cover_index.find(h);
+  if (f != cover_index.end()) {
+    cover_lru.erase(f->second);
+    cover_index.erase(f);
+  }
+  CachedCover entry = {h, polygon, level, cover};
+  cover_lru.push_front(entry);
+  cover_index[h] = cover_lru.begin();
+  if (cover_lru.size() > MAX_CACHED_COVERS) {
+    cover_index.erase(cover_lru.back().hash);
+    cover_lru.pop_back();
+  }
+  return cover;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "query_plan.h"
+
+// Polygons on quadtree dimensions (see quadtree.h). Vertices are
+// (lat, lon) pairs in degrees, projected with mercator_unit; the ring
+// closes by itself, and its inside follows the even-odd rule.
+
+typedef std::vector<std::pair<double, double> > Polygon;
+
+// a polygon cover has at most this many cells by default
+static const size_t POLYGON_MAX_CELLS = 1 << 16;
+
+// the cells of a quadtree, at most `level` levels down, that cover the
+// polygon: the largest cells inside it are taken whole, and the cells
+// its edges cut through are refined down to `level`, where they count
+// if their center is inside. The cover is sorted in z-order. When it
+// would have more than max_cells cells, it is made at the finest
+// coarser level where it doesn't (or at level 0). Returns the level
+// used.
+int polygon_cover(const Polygon &polygon, int level, PrefixSet &cover,
+                  size_t max_cells = POLYGON_MAX_CELLS);
+
+// polygon_cover, remembered for the most recently used polygons so
+// that repeated queries skip the rasterization. Safe to use from
+// several threads.
+std::shared_ptr<const PrefixSet> cached_polygon_cover(const Polygon &polygon,
+                                                      int level);
@@ -0,0 +1,71 @@
+#pragma once
+
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <cmath>
+#include <cstdint>
+
+// Quadtree dimensions. A quadtree of L levels is stored as a dimension
+// of width 2L whose addresses are Morton (Z-order) codes: bit 2i of the
+// address is bit i of x, and bit 2i+1 is bit i of y, with x growing
+// eastwards and y northwards (see loc2addr in ncserver.cc). Walking the
+// refinement tree from the root consumes y and x bits alternately, most
+// significant first, so the prefix of depth 2z of an address is the
+// Morton code of its cell at level z.
+
+inline int64_t morton_encode(uint32_t x, uint32_t y)
+{
+  int64_t z = 0;
+  for (int i = 0; i < 32; ++i) {
+    z |= (int64_t) ((x >> i) & 1) << (2*i);
+    z |= (int64_t) ((y >> i) & 1) << (2*i + 1);
+  }
+  return z;
+}
+
+inline void morton_decode(int64_t z, uint32_t &x, uint32_t &y)
+{
+  x = 0;
+  y = 0;
+  for (int i = 0; i < 32; ++i) {
+    x |= (uint32_t) ((z >> (2*i)) & 1) << i;
+    y |= (uint32_t) ((z >> (2*i + 1)) & 1) << i;
+  }
+}
+
+// Web map tiles (z, x, y) count y from the north, quadtree cells from the
+// south. Returns false if the tile doesn't exist in a quadtree of the
+// given number of levels; otherwise sets the address and depth of the
+// tile's prefix.
+inline bool tile_prefix(int levels, int zoom, int64_t x, int64_t y,
+                        int64_t &address, int &depth)
+{
+  if (zoom < 0 || zoom > levels) {
+    return false;
+  }
+  int64_t n = (int64_t) 1 << zoom;
+  if (x < 0 || x >= n || y < 0 || y >= n) {
+    return false;
+  }
+  address = morton_encode(x, n - 1 - y);
+  depth = 2 * zoom;
+  return true;
+}
+
+// map tiles are split into at most 2^MAX_TILE_LEVELS cells a side
+// (256x256), and fewer when the quadtree runs out of levels first
+static const int MAX_TILE_LEVELS = 8;
+
+inline int tile_levels(int levels, int zoom)
+{
+  return levels - zoom < MAX_TILE_LEVELS ? levels - zoom : MAX_TILE_LEVELS;
+}
+
+// web mercator projection of (lat, lon), in radians, onto the unit
+// square: the x and y that loc2addr (ncserver.cc) scales by the number
+// of cells a side
+inline void mercator_unit(double lat, double lon, double &x, double &y)
+{
+  x = (lon + M_PI) / (2.0 * M_PI);
+  y = (log(tan(M_PI / 4.0 + lat / 2.0)) + M_PI) / (2.0 * M_PI);
+}
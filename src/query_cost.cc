@@ -0,0 +1,224 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include "query_cost.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+double NCStats::Dim::per_tree(int depth) const
+{
+  if (depth < 0 || depth > width || trees == 0) {
+    return 0.0;
+  }
+  return min((double) nodes_at_depth[depth] / trees, ldexp(1.0, depth));
+}
+
+json NCStats::to_json() const
+{
+  json j = json::array();
+  for (size_t d = 0; d < dims.size(); ++d) {
+    json dim;
+    dim["width"] = dims[d].width;
+    dim["trees"] = dims[d].trees;
+    dim["nodes_at_depth"] = dims[d].nodes_at_depth;
+    j.push_back(dim);
+  }
+  return j;
+}
+
+namespace {
+
+// probability that one given node at depth exists in a tree
+double existence(const NCStats::Dim &s, int depth)
+{
+  return s.per_tree(depth) / ldexp(1.0, depth);
+}
+
+QueryCost::Dim estimate_clause(const DimOp &op, const NCStats::Dim &s)
+{
+  QueryCost::Dim c;
+  c.trees = 0.0;
+  c.frontier_per_tree = 0.0;
+  c.visited_per_tree = 0.0;
+  switch (op.kind) {
+    case OP_ALL:
+      c.frontier_per_tree = 1.0;
+      c.visited_per_tree = 1.0;
+      break;
+    case OP_FIND: {
+      // one path down to the prefix
+      int depth = min(op.prefix_depth, s.width);
+      for (int k = 0; k <= depth; ++k) {
+        c.visited_per_tree += existence(s, k);
+      }
+      c.frontier_per_tree = existence(s, depth);
+      break;
+    }
+    case OP_SPLIT:
+    case OP_TOPK: {
+      // the path to the prefix, then its whole subtree down to the
+      // split depth. A topk walk prunes most of that, but there's no
+      // telling how much from the stats
+      int depth = min(op.prefix_depth, s.width);
+      int end = min(op.prefix_depth + op.resolution, s.width);
+      double share = ldexp(1.0, -depth);
+      for (int k = 0; k < depth; ++k) {
+        c.visited_per_tree += existence(s, k);
+      }
+      for (int k = depth; k <= end; ++k) {
+        c.visited_per_tree += s.per_tree(k) * share;
+      }
+      c.frontier_per_tree = s.per_tree(end) * share;
+      if (op.kind == OP_TOPK) {
+        c.frontier_per_tree = min(c.frontier_per_tree, (double) op.k);
+      }
+      break;
+    }
+    case OP_RANGE: {
+      // the walk follows the two boundary paths; the cover takes at
+      // most two nodes per depth, each only as likely as the range
+      // is wide
+      int depth = min(max(op.lower_depth, op.upper_depth), s.width);
+      double lo = ldexp((double) op.lower_address, -op.lower_depth);
+      double up = ldexp((double) op.upper_address, -op.upper_depth);
+      double fraction = max(0.0, min(1.0, up - lo));
+      for (int k = 0; k <= depth; ++k) {
+        c.visited_per_tree += min(s.per_tree(k), 4.0 * existence(s, k));
+        c.frontier_per_tree += min(s.per_tree(k) * fraction,
+                                   2.0 * existence(s, k));
+      }
+      c.frontier_per_tree = min(c.frontier_per_tree, s.per_tree(depth) * fraction +
+                                existence(s, 0));
+      break;
+    }
+    case OP_BBOX: {
+      // the walk goes down the cells the rectangle's edges cut
+      // through, a band as long as its perimeter at every depth, and
+      // the cover takes the nodes next to that band
+      int depth = min(2 * op.level, s.width);
+      double w = min(1.0, ldexp(max(0.0, (double) (op.x1 - op.x0 + 1)), -op.level));
+      double h = min(1.0, ldexp(max(0.0, (double) (op.y1 - op.y0 + 1)), -op.level));
+      for (int k = 0; k <= depth; ++k) {
+        double band = min(ldexp(1.0, k),
+                          2.0 * (w + h) * ldexp(1.0, (k + 1) / 2) + 4.0);
+        c.visited_per_tree += min(s.per_tree(k), band * existence(s, k));
+        c.frontier_per_tree += min(s.per_tree(k) * w * h, band * existence(s, k));
+      }
+      c.frontier_per_tree = min(c.frontier_per_tree, s.per_tree(depth) * w * h +
+                                existence(s, 0));
+      break;
+    }
+    case OP_RANGES: {
+      // at most the cost of the ranges one by one
+      for (size_t i = 0; i < op.intervals->size(); ++i) {
+        const Interval &interval = (*op.intervals)[i];
+        DimOp range;
+        range.kind = OP_RANGE;
+        range.lower_address = interval.lower_address;
+        range.lower_depth = interval.lower_depth;
+        range.upper_address = interval.upper_address;
+        range.upper_depth = interval.upper_depth;
+        QueryCost::Dim one = estimate_clause(range, s);
+        c.visited_per_tree += one.visited_per_tree;
+        c.frontier_per_tree += one.frontier_per_tree;
+      }
+      break;
+    }
+    case OP_POLYGON:
+    case OP_IN: {
+      // the walk visits the ancestors of the set's nodes, each as
+      // likely to exist as any node at its depth
+      const PrefixSet &prefixes = *op.prefixes;
+      vector<int64_t> last(s.width + 1, -1);
+      for (size_t i = 0; i < prefixes.size(); ++i) {
+        int depth = min(prefixes[i].second, s.width);
+        int64_t address = prefixes[i].first >> (prefixes[i].second - depth);
+        for (int k = 0; k <= depth; ++k) {
+          int64_t ancestor = address >> (depth - k);
+          if (ancestor != last[k]) {
+            last[k] = ancestor;
+            c.visited_per_tree += existence(s, k);
+          }
+        }
+        c.frontier_per_tree += existence(s, depth);
+      }
+      break;
+    }
+  }
+  return c;
+}
+
+const char *op_name(QueryOpKind kind)
+{
+  switch (kind) {
+    case OP_ALL: return "all";
+    case OP_FIND: return "find";
+    case OP_SPLIT: return "split";
+    case OP_RANGE: return "range";
+    case OP_TOPK: return "topk";
+    case OP_BBOX: return "bbox";
+    case OP_POLYGON: return "polygon";
+    case OP_IN: return "in";
+    case OP_RANGES: return "ranges";
+  }
+  return "";
+}
+
+};
+
+QueryCost estimate_cost(const QueryPlan &plan, const NCStats &stats,
+                        bool parallel, size_t parallel_threshold)
+{
+  QueryCost cost;
+  cost.nodes_visited = 0.0;
+  cost.strategy = QueryCost::SERIAL;
+  double trees = 1.0;
+  double distinct_cells = 1.0;
+  size_t n = min(plan.ops.size(), stats.dims.size());
+  for (size_t d = 0; d < n; ++d) {
+    QueryCost::Dim c = estimate_clause(plan.ops[d], stats.dims[d]);
+    c.trees = trees;
+    cost.dims.push_back(c);
+    cost.nodes_visited += trees * c.visited_per_tree;
+    if (parallel && d + 1 < n && c.frontier_per_tree >= parallel_threshold) {
+      cost.strategy = QueryCost::PARALLEL;
+    }
+    const DimOp &op = plan.ops[d];
+    if (op.kind == OP_SPLIT || op.kind == OP_TOPK) {
+      int bits = min(op.prefix_depth + op.resolution, stats.dims[d].width) -
+          min(op.prefix_depth, stats.dims[d].width);
+      distinct_cells *= min(ldexp(1.0, bits), trees * c.frontier_per_tree);
+      if (op.kind == OP_TOPK) {
+        distinct_cells = min(distinct_cells, (double) op.k);
+      }
+    }
+    trees *= c.frontier_per_tree;
+  }
+  cost.summaries_read = trees;
+  cost.result_cells = plan.key_dims.empty() ? 1.0 : min(distinct_cells, trees);
+  return cost;
+}
+
+json QueryCost::to_json(const QueryPlan &plan) const
+{
+  json j;
+  json per_dim = json::array();
+  for (size_t d = 0; d < dims.size(); ++d) {
+    json dim;
+    dim["dim"] = d;
+    dim["operation"] = op_name(plan.ops[d].kind);
+    dim["trees"] = dims[d].trees;
+    dim["frontier_per_tree"] = dims[d].frontier_per_tree;
+    dim["visited_per_tree"] = dims[d].visited_per_tree;
+    per_dim.push_back(dim);
+  }
+  j["dims"] = per_dim;
+  j["nodes_visited"] = nodes_visited;
+  j["summaries_read"] = summaries_read;
+  j["result_cells"] = result_cells;
+  j["cost"] = total();
+  j["strategy"] = strategy == PARALLEL ? "parallel" : "serial";
+  return j;
+}
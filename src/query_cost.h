@@ -0,0 +1,67 @@
+#pragma once
+
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "json.hpp"
+#include "nanocube.h"
+#include "query_plan.h"
+
+using json = nlohmann::json;
+
+// Node statistics of a built nanocube, for the cost model: per
+// dimension, the number of distinct trees (the roots that the previous
+// dimension's next pointers lead to, or base_root) and the number of
+// distinct nodes at each depth.
+struct NCStats {
+  struct Dim {
+    int width;
+    size_t trees;
+    std::vector<size_t> nodes_at_depth; // width + 1 entries
+
+    // expected nodes at depth per tree, assuming uniform addresses
+    double per_tree(int depth) const;
+  };
+
+  template <typename Summary>
+  void collect(const Nanocube<Summary> &nc);
+
+  json to_json() const;
+
+  std::vector<Dim> dims;
+};
+
+// Estimated cost of a plan. Each dimension is walked once per tree the
+// previous dimension's frontier leads to; within a tree the estimates
+// of a clause come from the per-depth node counts, assuming addresses
+// are spread uniformly and ignoring node sharing.
+struct QueryCost {
+  enum Strategy { SERIAL, PARALLEL };
+
+  struct Dim {
+    double trees;             // trees of this dimension the walk enters
+    double frontier_per_tree; // nodes the clause selects in each
+    double visited_per_tree;  // nodes it examines in each
+  };
+
+  std::vector<Dim> dims;
+  double nodes_visited;   // over all dimensions
+  double summaries_read;  // frontier of the last dimension
+  double result_cells;
+  Strategy strategy;
+
+  // the work the budget is checked against
+  double total() const { return nodes_visited + summaries_read; }
+
+  json to_json(const QueryPlan &plan) const;
+};
+
+// parallel is the ExecutionOptions pool being set, threshold its
+// parallel_threshold: frontiers at least this large fan out
+QueryCost estimate_cost(const QueryPlan &plan, const NCStats &stats,
+                        bool parallel, size_t parallel_threshold);
+
+#include "query_cost.inc"
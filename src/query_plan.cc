@@ -0,0 +1,242 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include "query_plan.h"
+#include "nanocube_traversals.h"
+#include "polygon.h"
+
+#include <algorithm>
+#include <string>
+
+using namespace std;
+
+bool compile_query(const json &q, int n_dims, QueryPlan &plan,
+                   bool insert_partial_overlap)
+{
+  // as deep as morton codes go
+  return compile_query(q, vector<int>(n_dims, 62), plan, insert_partial_overlap);
+}
+
+bool compile_query(const json &q, const vector<int> &widths, QueryPlan &plan,
+                   bool insert_partial_overlap)
+{
+  int n_dims = widths.size();
+  if (!isQueryValid(q)) {
+    return false;
+  }
+  plan.ops.assign(n_dims, DimOp());
+  plan.insert_partial_overlap = insert_partial_overlap;
+  plan.key_dims.clear();
+
+  for (int dim = 0; dim < n_dims; ++dim) {
+    auto f = q.find(to_string(dim));
+    if (f == q.end()) {
+      continue; // no clause for this dimension means "all"
+    }
+    const json &clause = *f;
+    const string &op_str = clause["operation"].get_ref<const string &>();
+    DimOp &op = plan.ops[dim];
+    if (op_str == "find") {
+      op.kind = OP_FIND;
+      op.prefix_address = clause["prefix"]["address"];
+      op.prefix_depth = clause["prefix"]["depth"];
+    } else if (op_str == "split") {
+      op.kind = OP_SPLIT;
+      op.prefix_address = clause["prefix"]["address"];
+      op.prefix_depth = clause["prefix"]["depth"];
+      op.resolution = clause["resolution"];
+      plan.key_dims.push_back(dim);
+    } else if (op_str == "topk") {
+      op.kind = OP_TOPK;
+      op.prefix_address = clause["prefix"]["address"];
+      op.prefix_depth = clause["prefix"]["depth"];
+      op.resolution = clause["resolution"];
+      op.k = clause["k"];
+      plan.key_dims.push_back(dim);
+    } else if (op_str == "bbox") {
+      op.kind = OP_BBOX;
+      op.level = clause["level"];
+      op.x0 = clause["x0"];
+      op.y0 = clause["y0"];
+      op.x1 = clause["x1"];
+      op.y1 = clause["y1"];
+    } else if (op_str == "polygon") {
+      op.kind = OP_POLYGON;
+      op.level = min(clause["level"].get<int>(), widths[dim] / 2);
+      Polygon polygon;
+      for (const json &point : clause["points"]) {
+        polygon.push_back(make_pair(point[0].get<double>(), point[1].get<double>()));
+      }
+      op.prefixes = cached_polygon_cover(polygon, op.level);
+    } else if (op_str == "in") {
+      op.kind = OP_IN;
+      std::shared_ptr<PrefixSet> prefixes = std::make_shared<PrefixSet>();
+      for (const json &prefix : clause["prefixes"]) {
+        prefixes->push_back(make_pair(prefix["address"].get<int64_t>(),
+                                      prefix["depth"].get<int>()));
+      }
+      normalize_prefix_set(*prefixes);
+      op.prefixes = prefixes;
+    } else if (op_str == "ranges") {
+      op.kind = OP_RANGES;
+      std::shared_ptr<vector<Interval> > intervals = std::make_shared<vector<Interval> >();
+      for (const json &interval : clause["intervals"]) {
+        Interval i;
+        i.lower_address = interval["lowerBound"]["address"];
+        i.lower_depth = interval["lowerBound"]["depth"];
+        i.upper_address = interval["upperBound"]["address"];
+        i.upper_depth = interval["upperBound"]["depth"];
+        intervals->push_back(i);
+      }
+      op.intervals = intervals;
+    } else if (op_str == "range") {
+      op.kind = OP_RANGE;
+      op.lower_address = clause["lowerBound"]["address"];
+      op.lower_depth = clause["lowerBound"]["depth"];
+      op.upper_address = clause["upperBound"]["address"];
+      op.upper_depth = clause["upperBound"]["depth"];
+    } else {
+      op.kind = OP_ALL;
+    }
+  }
+  if (topk_dim(plan) != -1 && plan.key_dims.size() > 1) {
+    return false;
+  }
+  return true;
+}
+
+void normalize_prefix_set(PrefixSet &prefixes)
+{
+  int depth = 0;
+  for (size_t i = 0; i < prefixes.size(); ++i) {
+    depth = max(depth, prefixes[i].second);
+  }
+  // by first address, and the larger of two prefixes starting together
+  // first
+  sort(prefixes.begin(), prefixes.end(),
+       [depth](const pair<int64_t, int> &a, const pair<int64_t, int> &b) {
+         int64_t first_a = a.first << (depth - a.second);
+         int64_t first_b = b.first << (depth - b.second);
+         return first_a < first_b || (first_a == first_b && a.second < b.second);
+       });
+  size_t kept = 0;
+  for (size_t i = 0; i < prefixes.size(); ++i) {
+    if (kept) {
+      const pair<int64_t, int> &last = prefixes[kept - 1];
+      const pair<int64_t, int> &p = prefixes[i];
+      if (p.second >= last.second &&
+          (p.first >> (p.second - last.second)) == last.first) {
+        continue;
+      }
+    }
+    prefixes[kept++] = prefixes[i];
+  }
+  prefixes.resize(kept);
+}
+
+int topk_dim(const QueryPlan &plan)
+{
+  for (size_t dim = 0; dim < plan.ops.size(); ++dim) {
+    if (plan.ops[dim].kind == OP_TOPK) {
+      return dim;
+    }
+  }
+  return -1;
+}
+
+int max_coarsening(const QueryPlan &plan)
+{
+  int result = 0;
+  for (size_t dim = 0; dim < plan.ops.size(); ++dim) {
+    const DimOp &op = plan.ops[dim];
+    if (op.kind == OP_SPLIT || op.kind == OP_TOPK) {
+      result = max(result, op.resolution);
+    } else if (op.kind == OP_RANGE) {
+      result = max(result, max(op.lower_depth, op.upper_depth));
+    } else if (op.kind == OP_BBOX) {
+      result = max(result, 2 * op.level);
+    } else if (op.kind == OP_POLYGON || op.kind == OP_IN) {
+      for (size_t i = 0; i < op.prefixes->size(); ++i) {
+        result = max(result, (*op.prefixes)[i].second);
+      }
+    } else if (op.kind == OP_RANGES) {
+      for (size_t i = 0; i < op.intervals->size(); ++i) {
+        const Interval &interval = (*op.intervals)[i];
+        result = max(result, max(interval.lower_depth, interval.upper_depth));
+      }
+    }
+  }
+  return result;
+}
+
+// rounds a range's bounds outwards to `levels` levels shallower: the
+// lower one down, the upper one up (but not past the last address at
+// its new depth)
+static void coarsen_bounds(int64_t &lower_address, int &lower_depth,
+                           int64_t &upper_address, int &upper_depth, int levels)
+{
+  int lower_drop = min(levels, lower_depth);
+  int upper_drop = min(levels, upper_depth);
+  lower_address >>= lower_drop;
+  lower_depth -= lower_drop;
+  upper_address = (upper_address + ((int64_t) 1 << upper_drop) - 1) >> upper_drop;
+  upper_depth -= upper_drop;
+  upper_address = min(upper_address, ((int64_t) 1 << upper_depth) - 1);
+}
+
+QueryPlan coarsen_plan(const QueryPlan &plan, int levels)
+{
+  QueryPlan result = plan;
+  if (levels <= 0) {
+    return result;
+  }
+  for (size_t dim = 0; dim < result.ops.size(); ++dim) {
+    DimOp &op = result.ops[dim];
+    if (op.kind == OP_SPLIT || op.kind == OP_TOPK) {
+      op.resolution = max(0, op.resolution - levels);
+    } else if (op.kind == OP_RANGE) {
+      coarsen_bounds(op.lower_address, op.lower_depth,
+                     op.upper_address, op.upper_depth, levels);
+      result.insert_partial_overlap = true;
+    } else if (op.kind == OP_BBOX) {
+      int drop = min((levels + 1) / 2, op.level);
+      op.level -= drop;
+      op.x0 >>= drop;
+      op.y0 >>= drop;
+      op.x1 >>= drop;
+      op.y1 >>= drop;
+      result.insert_partial_overlap = true;
+    } else if (op.kind == OP_RANGES) {
+      std::shared_ptr<vector<Interval> > coarse =
+          std::make_shared<vector<Interval> >(*op.intervals);
+      for (size_t i = 0; i < coarse->size(); ++i) {
+        Interval &interval = (*coarse)[i];
+        coarsen_bounds(interval.lower_address, interval.lower_depth,
+                       interval.upper_address, interval.upper_depth, levels);
+      }
+      op.intervals = coarse;
+      result.insert_partial_overlap = true;
+    } else if (op.kind == OP_POLYGON || op.kind == OP_IN) {
+      // cut the set off `levels` levels above its deepest nodes; the
+      // nodes sharing an ancestor there are consecutive
+      int depth = 0;
+      for (size_t i = 0; i < op.prefixes->size(); ++i) {
+        depth = max(depth, (*op.prefixes)[i].second);
+      }
+      depth = max(0, depth - levels);
+      std::shared_ptr<PrefixSet> coarse = std::make_shared<PrefixSet>();
+      for (size_t i = 0; i < op.prefixes->size(); ++i) {
+        pair<int64_t, int> p = (*op.prefixes)[i];
+        if (p.second > depth) {
+          p.first >>= p.second - depth;
+          p.second = depth;
+        }
+        if (coarse->empty() || coarse->back() != p) {
+          coarse->push_back(p);
+        }
+      }
+      op.prefixes = coarse;
+      result.insert_partial_overlap = true;
+    }
+  }
+  return result;
+}
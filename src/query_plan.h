@@ -0,0 +1,156 @@
+#pragma once
+
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "json.hpp"
+
+using namespace std;
+using json = nlohmann::json;
+
+///////////////////////////////////////////////////////////////////////////////
+// Data Structures
+///////////////////////////////////////////////////////////////////////////////
+
+// disjoint nodes of a refinement tree, as (address, depth) prefixes,
+// sorted by the first address they cover
+typedef std::vector<std::pair<int64_t, int> > PrefixSet;
+
+// the bounds of a range clause
+struct Interval {
+  int64_t lower_address;
+  int lower_depth;
+  int64_t upper_address;
+  int upper_depth;
+
+  bool operator==(const Interval &other) const {
+    return lower_address == other.lower_address &&
+        lower_depth == other.lower_depth &&
+        upper_address == other.upper_address &&
+        upper_depth == other.upper_depth;
+  }
+};
+
+// whether two shared lists are the same, by address or by contents
+template <typename T>
+bool same_list(const std::shared_ptr<const T> &a, const std::shared_ptr<const T> &b)
+{
+  return a == b || (a && b && *a == *b);
+}
+
+enum QueryOpKind {
+  OP_ALL,
+  OP_FIND,
+  OP_SPLIT,
+  OP_RANGE,
+  OP_TOPK,
+  OP_BBOX,
+  OP_POLYGON,
+  OP_IN,
+  OP_RANGES
+};
+
+// a single dimension's clause, with its bounds already pulled out of
+// the json query
+struct DimOp {
+  DimOp(): kind(OP_ALL), prefix_address(0), prefix_depth(0), resolution(0),
+           lower_address(0), lower_depth(0), upper_address(0), upper_depth(0),
+           k(0), level(0), x0(0), y0(0), x1(0), y1(0) {};
+
+  QueryOpKind kind;
+  int64_t prefix_address;  // find, split, topk
+  int prefix_depth;
+  int resolution;          // split, topk
+  int64_t lower_address;   // range
+  int lower_depth;
+  int64_t upper_address;
+  int upper_depth;
+  int k;                   // topk: how many cells
+  int level;               // bbox: quadtree level of the corners,
+  int64_t x0, y0, x1, y1;  // inclusive
+  std::shared_ptr<const PrefixSet> prefixes; // polygon: its cover; in
+  std::shared_ptr<const std::vector<Interval> > intervals; // ranges
+
+  // same clause, i.e. same frontier from any starting node
+  bool operator==(const DimOp &other) const {
+    return kind == other.kind &&
+        prefix_address == other.prefix_address &&
+        prefix_depth == other.prefix_depth &&
+        resolution == other.resolution &&
+        lower_address == other.lower_address &&
+        lower_depth == other.lower_depth &&
+        upper_address == other.upper_address &&
+        upper_depth == other.upper_depth &&
+        k == other.k &&
+        level == other.level &&
+        x0 == other.x0 && y0 == other.y0 &&
+        x1 == other.x1 && y1 == other.y1 &&
+        same_list(prefixes, other.prefixes) &&
+        same_list(intervals, other.intervals);
+  }
+  bool operator!=(const DimOp &other) const { return !(*this == other); }
+};
+
+// a json query compiled once into one operation per dimension, so that
+// execution never touches the json again.
+//
+// A topk clause splits like a split clause, but only keeps the k cells
+// of highest SummaryTraits::rank; it must be the plan's only keyed
+// dimension. A bbox clause, on a quadtree dimension (see quadtree.h),
+// selects the cells of a level inside a rectangle of x0..x1 by y0..y1,
+// and a polygon clause the cover of a polygon (see polygon.h) down to a
+// level. in and ranges clauses are unions of find and range clauses:
+// nodes in more than one of them only count once.
+struct QueryPlan {
+  QueryPlan(): insert_partial_overlap(false) {};
+
+  std::vector<DimOp> ops;
+  bool insert_partial_overlap;
+
+  // dimensions whose addresses are part of the result key, in order
+  // (the split dimensions)
+  std::vector<int> key_dims;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Compilation
+///////////////////////////////////////////////////////////////////////////////
+
+// returns false if q isn't a valid query (see isQueryValid). Clauses for
+// dimensions the nanocube doesn't have are ignored, and dimensions with
+// no clause get OP_ALL.
+bool compile_query(const json &q, int n_dims, QueryPlan &plan,
+                   bool insert_partial_overlap = false);
+
+// compile_query for a nanocube whose dimensions have these widths:
+// polygons aren't rasterized past the levels of their quadtree
+bool compile_query(const json &q, const std::vector<int> &widths,
+                   QueryPlan &plan, bool insert_partial_overlap = false);
+
+// sorts prefixes by the first address they cover, and drops those
+// inside others, making a PrefixSet of them
+void normalize_prefix_set(PrefixSet &prefixes);
+
+// the dimension of plan's topk clause, or -1
+int topk_dim(const QueryPlan &plan);
+
+///////////////////////////////////////////////////////////////////////////////
+// Coarsening
+///////////////////////////////////////////////////////////////////////////////
+
+// the most refinement levels any split or range of plan goes down, i.e.
+// how far coarsen_plan can take it
+int max_coarsening(const QueryPlan &plan);
+
+// plan answered `levels` levels of refinement coarser: splits (and
+// topks) lose that much resolution (down to 0), and range bounds,
+// bboxes and prefix sets are rounded outwards to that many levels
+// shallower (bboxes to half as many quadtree levels), so the cells
+// they only partially overlap are counted whole (the
+// insert_partial_overlap answer at the coarser depth).
+// coarsen_plan(plan, 0) is plan.
+QueryPlan coarsen_plan(const QueryPlan &plan, int levels);
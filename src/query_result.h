@@ -0,0 +1,46 @@
+#pragma once
+
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Native query result: a flat hash map from address tuples (one address
+// per keyed dimension of the plan, see QueryPlan::key_dims) to
+// summaries. Keys live contiguously in `keys`, key_size int64s each, in
+// insertion order, next to their summary in `values`; `slots` is an
+// open-addressing index into them. With key_size == 0 the result is a
+// single summary.
+template <typename Summary>
+struct QueryResult {
+  explicit QueryResult(int key_size = 0);
+
+  // summary stored under key, inserting Summary() if absent
+  inline Summary &at(const int64_t *key);
+
+  inline void add(const int64_t *key, const Summary &s) { at(key) += s; }
+
+  // adds every entry of other (which must have the same key_size)
+  void merge(const QueryResult<Summary> &other);
+
+  size_t size() const { return values.size(); }
+  bool empty() const { return values.empty(); }
+  const int64_t *key(size_t i) const { return keys.data() + i * key_size; }
+  const Summary &value(size_t i) const { return values[i]; }
+
+  void clear();
+
+  int key_size;
+  std::vector<int64_t> keys;
+  std::vector<Summary> values;
+
+ private:
+  inline size_t hash(const int64_t *key) const;
+  void grow();
+
+  std::vector<int> slots;
+  size_t mask;
+};
+
+#include "query_result.inc"
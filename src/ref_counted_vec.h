@@ -2,6 +2,7 @@
 
 // Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
 
+#include <cstddef>
 #include <vector>
 #include <map>
 #include <cassert>
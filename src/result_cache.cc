@@ -0,0 +1,148 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include "result_cache.h"
+
+#include <cmath>
+
+using namespace std;
+
+namespace {
+
+json normalized(const json &j)
+{
+  if (j.is_object()) {
+    json result = json::object();
+    for (auto it = j.begin(); it != j.end(); ++it) {
+      result[it.key()] = normalized(it.value());
+    }
+    return result;
+  } else if (j.is_array()) {
+    json result = json::array();
+    for (auto it = j.begin(); it != j.end(); ++it) {
+      result.push_back(normalized(*it));
+    }
+    return result;
+  } else if (j.is_number_float()) {
+    double d = j.get<double>();
+    if (d == floor(d) && fabs(d) < 9.0e15) {
+      return json((int64_t) d);
+    }
+    return j;
+  } else if (j.is_number_unsigned()) {
+    return json((int64_t) j.get<uint64_t>());
+  }
+  return j;
+}
+
+};
+
+string canonical_query(const json &q)
+{
+  return normalized(q).dump();
+}
+
+/******************************************************************************/
+
+ResultCache::ResultCache(size_t max_bytes):
+    version_(0), bytes_(0), max_bytes_(max_bytes),
+    hits_(0), misses_(0), insertions_(0), evictions_(0), invalidations_(0) {}
+
+size_t ResultCache::entry_bytes(const string &key, const string &response)
+{
+  // the strings plus a rough allowance for the list and hash nodes
+  return key.size() * 2 + response.size() + 128;
+}
+
+bool ResultCache::set_version(uint64_t version)
+{
+  if (version <= version_) {
+    return version == version_;
+  }
+  if (!lru_.empty()) {
+    ++invalidations_;
+  }
+  lru_.clear();
+  index_.clear();
+  bytes_ = 0;
+  version_ = version;
+  return true;
+}
+
+void ResultCache::evict_to(size_t bytes)
+{
+  while (bytes_ > bytes && !lru_.empty()) {
+    const Entry &e = lru_.back();
+    bytes_ -= entry_bytes(e.key, e.response);
+    index_.erase(e.key);
+    lru_.pop_back();
+    ++evictions_;
+  }
+}
+
+bool ResultCache::get(const string &key, uint64_t version, string &response)
+{
+  lock_guard<mutex> lock(mutex_);
+  auto f = set_version(version) ? index_.find(key) : index_.end();
+  if (f == index_.end()) {
+    ++misses_;
+    return false;
+  }
+  lru_.splice(lru_.begin(), lru_, f->second);
+  response = f->second->response;
+  ++hits_;
+  return true;
+}
+
+void ResultCache::put(const string &key, uint64_t version, const string &response)
+{
+  size_t size = entry_bytes(key, response);
+  lock_guard<mutex> lock(mutex_);
+  if (!set_version(version) || size > max_bytes_) {
+    return;
+  }
+  auto f = index_.find(key);
+  if (f != index_.end()) {
+    // computed concurrently by another worker; keep the newer copy
+    bytes_ -= entry_bytes(f->second->key, f->second->response);
+    lru_.erase(f->second);
+    index_.erase(f);
+  }
+  evict_to(max_bytes_ - size);
+  Entry e = { key, response };
+  lru_.push_front(e);
+  index_[key] = lru_.begin();
+  bytes_ += size;
+  ++insertions_;
+}
+
+void ResultCache::clear()
+{
+  lock_guard<mutex> lock(mutex_);
+  lru_.clear();
+  index_.clear();
+  bytes_ = 0;
+}
+
+ResultCache::Stats ResultCache::stats() const
+{
+  lock_guard<mutex> lock(mutex_);
+  Stats s = { hits_, misses_, insertions_, evictions_, invalidations_,
+              lru_.size(), bytes_, max_bytes_ };
+  return s;
+}
+
+json ResultCache::stats_json() const
+{
+  Stats s = stats();
+  json j;
+  j["hits"] = s.hits;
+  j["misses"] = s.misses;
+  j["hit_rate"] = s.hits + s.misses ? (double) s.hits / (s.hits + s.misses) : 0.0;
+  j["insertions"] = s.insertions;
+  j["evictions"] = s.evictions;
+  j["invalidations"] = s.invalidations;
+  j["entries"] = s.entries;
+  j["bytes"] = s.bytes;
+  j["max_bytes"] = s.max_bytes;
+  return j;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+// canonical text of a query: object keys sorted (json objects already
+// are), and numbers normalized so that 3, 3.0 and 3u print the same.
+std::string canonical_query(const json &q);
+
+// LRU cache of serialized query responses, keyed on the canonical
+// query, bounded by a byte budget. Entries belong to one version of the
+// cube (Nanocube::version); the first lookup or insertion at a newer
+// version drops them all, and lookups and insertions at an older one
+// (from queries that started before the cube changed) miss and are
+// ignored. Safe to use from several threads.
+class ResultCache {
+ public:
+  struct Stats {
+    uint64_t hits, misses, insertions, evictions, invalidations;
+    size_t entries, bytes, max_bytes;
+  };
+
+  explicit ResultCache(size_t max_bytes);
+
+  // on a hit, copies the cached response into response
+  bool get(const std::string &key, uint64_t version, std::string &response);
+
+  // responses bigger than the whole budget are not cached
+  void put(const std::string &key, uint64_t version,
+           const std::string &response);
+
+  void clear();
+
+  Stats stats() const;
+  json stats_json() const;
+
+ private:
+  struct Entry {
+    std::string key;
+    std::string response;
+  };
+  typedef std::list<Entry> EntryList;
+
+  static size_t entry_bytes(const std::string &key, const std::string &response);
+
+  // callers hold mutex_. Moves up to version if it is newer; false if
+  // it is older than the entries'
+  bool set_version(uint64_t version);
+  void evict_to(size_t bytes);
+
+  mutable std::mutex mutex_;
+  EntryList lru_; // most recently used first
+  std::unordered_map<std::string, EntryList::iterator> index_;
+  uint64_t version_;
+  size_t bytes_, max_bytes_;
+  uint64_t hits_, misses_, insertions_, evictions_, invalidations_;
+};
@@ -0,0 +1,43 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include "result_encoding.h"
+
+#include <algorithm>
+
+using namespace std;
+
+void append_le(string &out, uint64_t value, int bytes)
+{
+  for (int b = 0; b < bytes; ++b) {
+    out.push_back((char) (value >> (8*b)));
+  }
+}
+
+int column_width(int64_t lo, int64_t hi)
+{
+  uint64_t range = (uint64_t) hi - (uint64_t) lo;
+  return range <= 0xff ? 1 : range <= 0xffff ? 2 :
+      range <= 0xffffffffULL ? 4 : 8;
+}
+
+int key_depth(const DimOp &op, int width)
+{
+  if (op.kind != OP_SPLIT && op.kind != OP_TOPK) {
+    return -1;
+  }
+  return min(op.prefix_depth + op.resolution, width);
+}
+
+bool write_chunks(const ChunkSource &source, const ChunkSink &sink)
+{
+  string chunk;
+  bool more = true;
+  while (more) {
+    more = source(chunk);
+    if (!sink(chunk)) {
+      return false;
+    }
+    chunk.clear();
+  }
+  return true;
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "nanocube.h"
+#include "query_plan.h"
+#include "query_result.h"
+#include "summary_traits.h"
+
+// Compact binary encoding of a QueryResult, written straight from the
+// native result. All integers are little-endian:
+//
+//   "NCB1"
+//   uint32 n_key_dims
+//   n_key_dims x { uint32 dimension, uint32 depth of its addresses }
+//   uint32 n_summary_columns   (SummaryTraits<Summary>::n_columns)
+//   uint64 n_rows
+//   n_key_dims address columns, then n_summary_columns summary columns,
+//   each: int64 reference, uint8 width, n_rows x width-byte values
+//
+// A column stores every value as (value - reference) in the fewest
+// bytes (1, 2, 4 or 8) that hold the largest difference. Row i of the
+// address columns is the key of row i of the summary columns. A result
+// without keyed dimensions has exactly one row.
+
+static const char BINARY_RESULT_MAGIC[] = "NCB1";
+static const char BINARY_RESULT_CONTENT_TYPE[] = "application/x-nanocube-result";
+
+void append_le(std::string &out, uint64_t value, int bytes);
+
+// the fewest bytes (1, 2, 4 or 8) that hold every value of lo..hi as a
+// difference from lo
+int column_width(int64_t lo, int64_t hi);
+
+// the depth of the addresses a keyed clause answers with, on a
+// dimension of the given width, or -1 if op isn't a split or a topk
+int key_depth(const DimOp &op, int width);
+
+// receives the output of the streaming writers one chunk at a time. It
+// may take the contents of the chunk (swap it out); the writer clears
+// it afterwards either way. Returning false stops the writer.
+typedef std::function<bool(std::string &chunk)> ChunkSink;
+
+// produces a streamed output one chunk at a time: appends the next
+// chunk to its argument, and returns false once that was the last one.
+// The writers below keep their place between chunks, so a stream can
+// stop after any chunk and go on later, on another thread.
+typedef std::function<bool(std::string &chunk)> ChunkSource;
+
+// passes every chunk of source on to sink; false if sink stopped it
+bool write_chunks(const ChunkSource &source, const ChunkSink &sink);
+
+// The binary encoding of result, column by column. result must outlive
+// the writer, and ok() be true before next() is called: it is false
+// for non-columnar summary types, and for keyed clauses key_depth
+// doesn't know.
+template <typename Summary>
+class BinaryResultWriter {
+ public:
+  BinaryResultWriter(const QueryResult<Summary> &result,
+                     const QueryPlan &plan,
+                     const Nanocube<Summary> &nc,
+                     size_t chunk_bytes = 64 << 10);
+
+  bool ok() const { return !header_.empty(); }
+
+  // see ChunkSource
+  bool next(std::string &chunk);
+
+ private:
+  int64_t value(int column, size_t row) const;
+
+  const QueryResult<Summary> &result_;
+  size_t chunk_bytes_;
+  std::string header_;  // up to the first column
+  int n_columns_;       // address and summary columns
+  size_t n_rows_;
+  int column_;          // column being written; -1 before the header
+  size_t row_;          // its next row
+  int64_t reference_;   // and its format
+  int width_;
+};
+
+// the whole binary encoding of result, appended to out. Returns false,
+// writing nothing, when BinaryResultWriter isn't ok().
+template <typename Summary>
+bool encode_binary_result(const QueryResult<Summary> &result,
+                          const QueryPlan &plan,
+                          const Nanocube<Summary> &nc,
+                          std::string &out);
+
+// The json of query_result_to_json(result), byte for byte what its
+// dump() would be, without building a json object: rows are sorted the
+// way json objects order their keys, and the nested objects are opened
+// and closed as the row keys change. Chunks are about chunk_bytes.
+// result must outlive the writer.
+template <typename Summary>
+class JsonResultWriter {
+ public:
+  JsonResultWriter(const QueryResult<Summary> &result,
+                   size_t chunk_bytes = 64 << 10);
+
+  // see ChunkSource
+  bool next(std::string &chunk);
+
+ private:
+  const QueryResult<Summary> &result_;
+  size_t chunk_bytes_;
+  std::vector<size_t> order_; // rows, sorted
+  size_t row_;                // next row to write
+};
+
+// JsonResultWriter's output, to sink. Returns false if sink stopped it.
+template <typename Summary>
+bool write_json_result(const QueryResult<Summary> &result,
+                       const ChunkSink &sink,
+                       size_t chunk_bytes = 64 << 10);
+
+// Tensor form of a result, for plans with one or more keyed dimensions
+// (splits, or a topk):
+//
+//   {"format": "dense" or "coo",
+//    "axes": [{"dim": d, "depth": e, "first": a, "size": n}, ...],
+//    "shape": [n, ...],
+//    "values": [...]            dense: every cell, row-major
+//    "indices": [...]}          coo only: row-major offset of each value
+//
+// with one axis per keyed dimension, in key order: the cells of axis
+// i are the addresses first..first+size-1 at depth e of dimension d.
+// Dense cells without a summary hold Summary(); coo lists only the
+// cells that have one, in row-major order.
+enum TensorLayout {
+  TENSOR_AUTO,   // dense when at least 1/TENSOR_DENSE_FILL of the cells are
+                 // set, and there are at most TENSOR_MAX_DENSE_CELLS
+  TENSOR_DENSE,  // dense up to TENSOR_MAX_DENSE_CELLS, coo beyond
+  TENSOR_COO
+};
+
+static const int TENSOR_DENSE_FILL = 4;
+static const uint64_t TENSOR_MAX_DENSE_CELLS = 1 << 24;
+
+// The tensor form of result, chunk by chunk like JsonResultWriter.
+// result must outlive the writer, and ok() be true before next() is
+// called: it is false if plan has no keyed dimension, or one key_depth
+// doesn't know, or if a key of result isn't on its axis.
+template <typename Summary>
+class TensorResultWriter {
+ public:
+  TensorResultWriter(const QueryResult<Summary> &result,
+                     const QueryPlan &plan,
+                     const Nanocube<Summary> &nc,
+                     TensorLayout layout = TENSOR_AUTO,
+                     size_t chunk_bytes = 64 << 10);
+
+  bool ok() const { return !header_.empty(); }
+
+  // see ChunkSource
+  bool next(std::string &chunk);
+
+ private:
+  enum Phase { HEADER, VALUES, INDICES, COO_VALUES };
+
+  const QueryResult<Summary> &result_;
+  size_t chunk_bytes_;
+  std::string header_;  // up to the values or indices array
+  bool dense_;
+  uint64_t cells_;
+  // (row-major offset, row) of every row, sorted
+  std::vector<std::pair<uint64_t, size_t> > rows_;
+  Phase phase_;
+  uint64_t position_;   // next cell or row of the phase
+};
+
+// Writes the tensor form of result to sink, like write_json_result.
+// Returns false if sink stopped it, or if the writer isn't ok().
+template <typename Summary>
+bool write_tensor_result(const QueryResult<Summary> &result,
+                         const QueryPlan &plan,
+                         const Nanocube<Summary> &nc,
+                         const ChunkSink &sink,
+                         TensorLayout layout = TENSOR_AUTO,
+                         size_t chunk_bytes = 64 << 10);
+
+#include "result_encoding.inc"
@@ -0,0 +1,506 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include "sketches.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace {
+
+// splitmix64 finalizer; callers usually hand us small integer ids, which
+// need to be spread over the whole 64-bit range.
+inline uint64_t mix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+inline uint32_t sparse_register(uint32_t entry) { return entry >> 8; }
+inline uint8_t sparse_rank(uint32_t entry) { return entry & 255; }
+inline uint32_t sparse_entry(uint32_t reg, uint8_t rank) { return (reg << 8) | rank; }
+
+// merges two sorted sparse lists, keeping the largest rank of each register
+void merge_sparse(const vector<uint32_t> &a, const vector<uint32_t> &b,
+                  vector<uint32_t> &out)
+{
+  out.clear();
+  out.reserve(a.size() + b.size());
+  size_t i = 0, j = 0;
+  while (i < a.size() && j < b.size()) {
+    uint32_t ra = sparse_register(a[i]), rb = sparse_register(b[j]);
+    if (ra < rb) {
+      out.push_back(a[i++]);
+    } else if (rb < ra) {
+      out.push_back(b[j++]);
+    } else {
+      out.push_back(max(a[i++], b[j++]));
+    }
+  }
+  out.insert(out.end(), a.begin() + i, a.end());
+  out.insert(out.end(), b.begin() + j, b.end());
+}
+
+inline void apply_sparse(const vector<uint32_t> &sparse, vector<uint8_t> &dense)
+{
+  for (size_t i=0; i<sparse.size(); ++i) {
+    uint8_t &r = dense[sparse_register(sparse[i])];
+    r = max(r, sparse_rank(sparse[i]));
+  }
+}
+
+};
+
+/******************************************************************************/
+// HyperLogLog
+
+HyperLogLog::Payload &HyperLogLog::mutable_payload()
+{
+  if (!payload_) {
+    payload_ = make_shared<Payload>();
+  } else if (payload_.use_count() > 1) {
+    payload_ = make_shared<Payload>(*payload_);
+  }
+  return *payload_;
+}
+
+void HyperLogLog::densify(Payload &p) const
+{
+  p.dense.assign(N_REGISTERS, 0);
+  apply_sparse(p.sparse, p.dense);
+  vector<uint32_t>().swap(p.sparse);
+}
+
+void HyperLogLog::add(uint64_t item)
+{
+  uint64_t h = mix64(item);
+  uint32_t reg = h >> (64 - PRECISION);
+  // the sentinel bit bounds the rank at 64 - PRECISION + 1
+  uint8_t rank = __builtin_clzll((h << PRECISION) | (1ULL << (PRECISION - 1))) + 1;
+
+  Payload &p = mutable_payload();
+  if (p.dense.size()) {
+    p.dense[reg] = max(p.dense[reg], rank);
+    return;
+  }
+  auto it = lower_bound(p.sparse.begin(), p.sparse.end(), sparse_entry(reg, 0));
+  if (it != p.sparse.end() && sparse_register(*it) == reg) {
+    *it = max(*it, sparse_entry(reg, rank));
+  } else {
+    p.sparse.insert(it, sparse_entry(reg, rank));
+    if (p.sparse.size() > SPARSE_LIMIT) {
+      densify(p);
+    }
+  }
+}
+
+size_t HyperLogLog::n_registers() const
+{
+  if (!payload_) {
+    return 0;
+  }
+  if (!is_dense()) {
+    return payload_->sparse.size();
+  }
+  return N_REGISTERS - count(payload_->dense.begin(), payload_->dense.end(), 0);
+}
+
+double HyperLogLog::estimate() const
+{
+  if (!payload_) {
+    return 0.0;
+  }
+  const double m = N_REGISTERS;
+  double sum = 0.0;
+  int zeros = 0;
+  if (is_dense()) {
+    for (int i=0; i<N_REGISTERS; ++i) {
+      sum += ldexp(1.0, -payload_->dense[i]);
+      zeros += payload_->dense[i] == 0;
+    }
+  } else {
+    const vector<uint32_t> &sparse = payload_->sparse;
+    zeros = N_REGISTERS - sparse.size();
+    sum = zeros;
+    for (size_t i=0; i<sparse.size(); ++i) {
+      sum += ldexp(1.0, -sparse_rank(sparse[i]));
+    }
+  }
+  double alpha = 0.7213 / (1.0 + 1.079 / m);
+  double e = alpha * m * m / sum;
+  // small-range correction: linear counting
+  if (e <= 2.5 * m && zeros > 0) {
+    e = m * log(m / zeros);
+  }
+  return e;
+}
+
+HyperLogLog &HyperLogLog::operator+=(const HyperLogLog &other)
+{
+  if (!other.payload_ || payload_ == other.payload_) {
+    return *this;
+  }
+  if (!payload_) {
+    payload_ = other.payload_;
+    return *this;
+  }
+  const Payload &o = *other.payload_;
+  if (is_dense()) {
+    Payload &p = mutable_payload();
+    if (o.dense.size()) {
+      uint8_t *d = &p.dense[0];
+      const uint8_t *s = &o.dense[0];
+      for (int i=0; i<N_REGISTERS; ++i) {
+        d[i] = d[i] < s[i] ? s[i] : d[i];
+      }
+    } else {
+      apply_sparse(o.sparse, p.dense);
+    }
+  } else if (o.dense.size()) {
+    shared_ptr<Payload> merged = make_shared<Payload>();
+    merged->dense = o.dense;
+    apply_sparse(payload_->sparse, merged->dense);
+    payload_ = merged;
+  } else {
+    shared_ptr<Payload> merged = make_shared<Payload>();
+    merge_sparse(payload_->sparse, o.sparse, merged->sparse);
+    if (merged->sparse.size() > SPARSE_LIMIT) {
+      densify(*merged);
+    }
+    payload_ = merged;
+  }
+  return *this;
+}
+
+HyperLogLog HyperLogLog::operator+(const HyperLogLog &other) const
+{
+  HyperLogLog result(*this);
+  result += other;
+  return result;
+}
+
+bool HyperLogLog::operator==(const HyperLogLog &other) const
+{
+  if (payload_ == other.payload_) {
+    return true;
+  }
+  if (!payload_ || !other.payload_) {
+    return false;
+  }
+  return payload_->sparse == other.payload_->sparse &&
+         payload_->dense == other.payload_->dense;
+}
+
+bool HyperLogLog::operator<(const HyperLogLog &other) const
+{
+  if (payload_ == other.payload_ || !other.payload_) {
+    return false;
+  }
+  if (!payload_) {
+    return true;
+  }
+  if (is_dense() != other.is_dense()) {
+    return !is_dense();
+  }
+  if (is_dense()) {
+    return payload_->dense < other.payload_->dense;
+  } else {
+    return payload_->sparse < other.payload_->sparse;
+  }
+}
+
+json HyperLogLog::to_json() const
+{
+  json result;
+  result["estimate"] = estimate();
+  if (is_dense()) {
+    result["dense"] = payload_->dense;
+  } else if (payload_) {
+    result["sparse"] = payload_->sparse;
+  }
+  return result;
+}
+
+HyperLogLog HyperLogLog::from_json(const json &j)
+{
+  HyperLogLog result;
+  if (j.count("dense")) {
+    Payload &p = result.mutable_payload();
+    p.dense = j["dense"].get<vector<uint8_t> >();
+    p.dense.resize(N_REGISTERS);
+  } else if (j.count("sparse")) {
+    result.mutable_payload().sparse = j["sparse"].get<vector<uint32_t> >();
+  }
+  return result;
+}
+
+std::ostream &operator<<(std::ostream &os, const HyperLogLog &h)
+{
+  os << "hll(" << llround(h.estimate()) << ")";
+  return os;
+}
+
+/******************************************************************************/
+// TDigest
+
+namespace {
+
+const double TWO_PI = 6.283185307179586;
+
+// the k_1 scale function of the t-digest paper, and its inverse
+inline double k_scale(double q, double delta)
+{
+  return delta / TWO_PI * asin(2.0 * q - 1.0);
+}
+
+inline double k_scale_inverse(double k, double delta)
+{
+  if (k >= delta / 4.0) {
+    return 1.0;
+  }
+  return (sin(k * TWO_PI / delta) + 1.0) / 2.0;
+}
+
+bool centroid_less(const Centroid &a, const Centroid &b)
+{
+  return a.mean < b.mean;
+}
+
+};
+
+TDigest::Payload &TDigest::mutable_payload()
+{
+  if (!payload_) {
+    payload_ = make_shared<Payload>();
+    payload_->total_weight = 0.0;
+    payload_->min = HUGE_VAL;
+    payload_->max = -HUGE_VAL;
+  } else if (payload_.use_count() > 1) {
+    payload_ = make_shared<Payload>(*payload_);
+  }
+  return *payload_;
+}
+
+// one pass of the merging t-digest: adjacent centroids are combined as
+// long as the result stays within one unit of the scale function.
+void TDigest::compress(Payload &p) const
+{
+  vector<Centroid> &cs = p.centroids;
+  if (cs.size() <= 1) {
+    return;
+  }
+  const double delta = COMPRESSION;
+  size_t out = 0;
+  double weight_so_far = 0.0;
+  double q_limit = k_scale_inverse(k_scale(0.0, delta) + 1.0, delta);
+  for (size_t i=1; i<cs.size(); ++i) {
+    Centroid &cur = cs[out];
+    double q = (weight_so_far + cur.weight + cs[i].weight) / p.total_weight;
+    if (q <= q_limit) {
+      double w = cur.weight + cs[i].weight;
+      cur.mean += (cs[i].mean - cur.mean) * cs[i].weight / w;
+      cur.weight = w;
+    } else {
+      weight_so_far += cur.weight;
+      q_limit = k_scale_inverse(
+          k_scale(weight_so_far / p.total_weight, delta) + 1.0, delta);
+      cs[++out] = cs[i];
+    }
+  }
+  cs.resize(out + 1);
+}
+
+void TDigest::add(double value, double weight)
+{
+  Payload &p = mutable_payload();
+  Centroid c(value, weight);
+  p.centroids.insert(upper_bound(p.centroids.begin(), p.centroids.end(), c, centroid_less), c);
+  p.total_weight += weight;
+  p.min = std::min(p.min, value);
+  p.max = std::max(p.max, value);
+  if (p.centroids.size() > 2 * COMPRESSION) {
+    compress(p);
+  }
+}
+
+double TDigest::count() const
+{
+  return payload_ ? payload_->total_weight : 0.0;
+}
+
+double TDigest::min() const
+{
+  return payload_ ? payload_->min : 0.0;
+}
+
+double TDigest::max() const
+{
+  return payload_ ? payload_->max : 0.0;
+}
+
+double TDigest::quantile(double q) const
+{
+  if (!payload_) {
+    return 0.0;
+  }
+  const Payload &p = *payload_;
+  const vector<Centroid> &cs = p.centroids;
+  if (q <= 0.0) {
+    return p.min;
+  }
+  if (q >= 1.0) {
+    return p.max;
+  }
+  if (cs.size() == 1) {
+    return cs[0].mean;
+  }
+  // interpolate between centroid centers, and between the outermost
+  // centroids and the observed extrema
+  double target = q * p.total_weight;
+  double previous_center = 0.0, previous_mean = p.min, cumulative = 0.0;
+  for (size_t i=0; i<cs.size(); ++i) {
+    double center = cumulative + cs[i].weight / 2.0;
+    if (target < center) {
+      double t = (target - previous_center) / (center - previous_center);
+      return previous_mean + t * (cs[i].mean - previous_mean);
+    }
+    cumulative += cs[i].weight;
+    previous_center = center;
+    previous_mean = cs[i].mean;
+  }
+  double t = (target - previous_center) / (p.total_weight - previous_center);
+  return previous_mean + t * (p.max - previous_mean);
+}
+
+TDigest &TDigest::operator+=(const TDigest &other)
+{
+  if (!other.payload_) {
+    return *this;
+  }
+  if (!payload_) {
+    payload_ = other.payload_;
+    return *this;
+  }
+  // both centroid lists are sorted, so the union is a linear merge
+  shared_ptr<Payload> merged = make_shared<Payload>();
+  const Payload &a = *payload_, &b = *other.payload_;
+  merged->centroids.resize(a.centroids.size() + b.centroids.size());
+  std::merge(a.centroids.begin(), a.centroids.end(),
+             b.centroids.begin(), b.centroids.end(),
+             merged->centroids.begin(), centroid_less);
+  merged->total_weight = a.total_weight + b.total_weight;
+  merged->min = std::min(a.min, b.min);
+  merged->max = std::max(a.max, b.max);
+  if (merged->centroids.size() > 2 * COMPRESSION) {
+    compress(*merged);
+  }
+  payload_ = merged;
+  return *this;
+}
+
+TDigest TDigest::operator+(const TDigest &other) const
+{
+  TDigest result(*this);
+  result += other;
+  return result;
+}
+
+bool TDigest::operator==(const TDigest &other) const
+{
+  if (payload_ == other.payload_) {
+    return true;
+  }
+  if (!payload_ || !other.payload_) {
+    return false;
+  }
+  const Payload &a = *payload_, &b = *other.payload_;
+  if (a.total_weight != b.total_weight || a.min != b.min || a.max != b.max ||
+      a.centroids.size() != b.centroids.size()) {
+    return false;
+  }
+  for (size_t i=0; i<a.centroids.size(); ++i) {
+    if (a.centroids[i].mean != b.centroids[i].mean ||
+        a.centroids[i].weight != b.centroids[i].weight) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TDigest::operator<(const TDigest &other) const
+{
+  if (payload_ == other.payload_ || !other.payload_) {
+    return false;
+  }
+  if (!payload_) {
+    return true;
+  }
+  const Payload &a = *payload_, &b = *other.payload_;
+  if (a.total_weight != b.total_weight) return a.total_weight < b.total_weight;
+  if (a.min != b.min) return a.min < b.min;
+  if (a.max != b.max) return a.max < b.max;
+  if (a.centroids.size() != b.centroids.size()) {
+    return a.centroids.size() < b.centroids.size();
+  }
+  for (size_t i=0; i<a.centroids.size(); ++i) {
+    if (a.centroids[i].mean != b.centroids[i].mean) {
+      return a.centroids[i].mean < b.centroids[i].mean;
+    }
+    if (a.centroids[i].weight != b.centroids[i].weight) {
+      return a.centroids[i].weight < b.centroids[i].weight;
+    }
+  }
+  return false;
+}
+
+json TDigest::to_json() const
+{
+  json result;
+  result["count"] = count();
+  if (!payload_) {
+    return result;
+  }
+  result["min"] = payload_->min;
+  result["max"] = payload_->max;
+  json quantiles;
+  quantiles["0.5"] = quantile(0.5);
+  quantiles["0.9"] = quantile(0.9);
+  quantiles["0.95"] = quantile(0.95);
+  quantiles["0.99"] = quantile(0.99);
+  result["quantiles"] = quantiles;
+  json centroids = json::array();
+  for (size_t i=0; i<payload_->centroids.size(); ++i) {
+    centroids.push_back({payload_->centroids[i].mean, payload_->centroids[i].weight});
+  }
+  result["centroids"] = centroids;
+  return result;
+}
+
+TDigest TDigest::from_json(const json &j)
+{
+  TDigest result;
+  if (!j.count("centroids") || j["centroids"].empty()) {
+    return result;
+  }
+  Payload &p = result.mutable_payload();
+  const json &centroids = j["centroids"];
+  for (auto it = centroids.begin(); it != centroids.end(); ++it) {
+    Centroid c((*it)[0].get<double>(), (*it)[1].get<double>());
+    p.centroids.push_back(c);
+    p.total_weight += c.weight;
+  }
+  p.min = j["min"];
+  p.max = j["max"];
+  return result;
+}
+
+std::ostream &operator<<(std::ostream &os, const TDigest &t)
+{
+  os << "tdigest(n=" << t.count()
+     << " p50=" << t.quantile(0.5)
+     << " p95=" << t.quantile(0.95) << ")";
+  return os;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <iostream>
+
+#include "json.hpp"
+#include "summary_traits.h"
+
+using json = nlohmann::json;
+
+// Mergeable sketch summaries. Both types can be used as the Summary
+// parameter of a Nanocube: operator+ is the sketch union, and the
+// default-constructed value is the empty sketch.
+//
+// The payload of a sketch (registers, centroids) lives in a shared,
+// heap-allocated block, so that the entries in summaries.values are
+// a single pointer wide and copying a summary around during queries
+// does not copy the payload. A payload is only ever mutated in place
+// when the sketch holding it is its sole owner.
+//
+// NB: write_to_binary_stream() dumps summaries.values byte-for-byte,
+// and so does not work with sketch summaries.
+
+/******************************************************************************/
+// HyperLogLog distinct counts
+
+class HyperLogLog {
+ public:
+  // 2^PRECISION registers; standard error is about 1.04 / sqrt(2^PRECISION)
+  static const int PRECISION = 12;
+  static const int N_REGISTERS = 1 << PRECISION;
+
+  // sketches with at most this many non-empty registers are kept as a
+  // sorted list of (register, rank) entries instead of a dense array
+  static const int SPARSE_LIMIT = N_REGISTERS / 4;
+
+  HyperLogLog() {}
+
+  // sketch of a single item
+  explicit HyperLogLog(uint64_t item) { add(item); }
+
+  void add(uint64_t item);
+
+  double estimate() const;
+
+  bool empty() const { return !payload_; }
+  bool is_dense() const { return payload_ && payload_->dense.size(); }
+
+  // number of non-empty registers
+  size_t n_registers() const;
+
+  HyperLogLog &operator+=(const HyperLogLog &other);
+  HyperLogLog operator+(const HyperLogLog &other) const;
+
+  // representation order: two sketches compare equal iff they have the
+  // same registers, which is all content_compact() needs.
+  bool operator==(const HyperLogLog &other) const;
+  bool operator!=(const HyperLogLog &other) const { return !(*this == other); }
+  bool operator<(const HyperLogLog &other) const;
+
+  json to_json() const;
+  static HyperLogLog from_json(const json &j);
+
+ private:
+  struct Payload {
+    // entries are (register << 8) | rank, sorted by register
+    std::vector<uint32_t> sparse;
+    std::vector<uint8_t> dense;
+  };
+
+  Payload &mutable_payload();
+  void densify(Payload &p) const;
+
+  std::shared_ptr<Payload> payload_;
+};
+
+std::ostream &operator<<(std::ostream &os, const HyperLogLog &h);
+
+/******************************************************************************/
+// t-digest quantile sketches
+
+struct Centroid {
+  Centroid() {}
+  Centroid(double m, double w): mean(m), weight(w) {}
+  double mean, weight;
+};
+
+class TDigest {
+ public:
+  // the "delta" compression parameter: a compressed digest has at most
+  // about 2*COMPRESSION centroids
+  static const int COMPRESSION = 100;
+
+  TDigest() {}
+
+  // digest of a single value
+  explicit TDigest(double value) { add(value); }
+
+  void add(double value, double weight=1.0);
+
+  double count() const;
+  double min() const;
+  double max() const;
+
+  // estimated value at quantile q in [0, 1]
+  double quantile(double q) const;
+
+  size_t n_centroids() const { return payload_ ? payload_->centroids.size() : 0; }
+  bool empty() const { return !payload_; }
+
+  TDigest &operator+=(const TDigest &other);
+  TDigest operator+(const TDigest &other) const;
+
+  bool operator==(const TDigest &other) const;
+  bool operator!=(const TDigest &other) const { return !(*this == other); }
+  bool operator<(const TDigest &other) const;
+
+  json to_json() const;
+  static TDigest from_json(const json &j);
+
+ private:
+  struct Payload {
+    // sorted by mean
+    std::vector<Centroid> centroids;
+    double total_weight, min, max;
+  };
+
+  Payload &mutable_payload();
+  void compress(Payload &p) const;
+
+  std::shared_ptr<Payload> payload_;
+};
+
+std::ostream &operator<<(std::ostream &os, const TDigest &t);
+
+/******************************************************************************/
+
+template <>
+struct SummaryTraits<HyperLogLog> {
+  static json to_json(const HyperLogLog &s) { return s.to_json(); }
+  static HyperLogLog from_json(const json &j) { return HyperLogLog::from_json(j); }
+  // merging only raises registers, so this is monotone up to the
+  // estimator's error
+  static double rank(const HyperLogLog &s) { return s.estimate(); }
+  static const bool columnar = false;
+};
+
+template <>
+struct SummaryTraits<TDigest> {
+  static json to_json(const TDigest &s) { return s.to_json(); }
+  static TDigest from_json(const json &j) { return TDigest::from_json(j); }
+  static double rank(const TDigest &s) { return s.count(); }
+  static const bool columnar = false;
+};
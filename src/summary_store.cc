@@ -0,0 +1,47 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include "summary_store.h"
+
+#include <algorithm>
+
+using namespace std;
+
+void PackedColumn::build(const vector<int64_t> &values)
+{
+  count = values.size();
+  words.clear();
+  if (count == 0) {
+    reference = 0;
+    bits = 0;
+    return;
+  }
+  reference = *min_element(values.begin(), values.end());
+  uint64_t range = (uint64_t) (*max_element(values.begin(), values.end()) - reference);
+  bits = range ? 64 - __builtin_clzll(range) : 0;
+  if (bits == 0) {
+    return;
+  }
+  // one word of padding, so get() can always read words[w+1]
+  words.assign((count * bits + 63) / 64 + 1, 0);
+  for (size_t i=0; i<count; ++i) {
+    uint64_t v = (uint64_t) (values[i] - reference);
+    size_t offset = i * bits;
+    size_t w = offset >> 6;
+    int shift = offset & 63;
+    words[w] |= v << shift;
+    if (shift + bits > 64) {
+      words[w+1] |= v >> (64 - shift);
+    }
+  }
+}
+
+void PackedColumn::gather(const int *indices, size_t n, int64_t *out) const
+{
+  if (bits == 0) {
+    fill(out, out + n, reference);
+    return;
+  }
+  for (size_t j=0; j<n; ++j) {
+    out[j] = get(indices[j]);
+  }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "summary_traits.h"
+
+// A frame-of-reference, bit-packed column of integers: every value is
+// stored as (value - reference) in just enough bits for the largest
+// difference. Count cubes mostly hold tiny numbers, so a column
+// typically needs a handful of bits per value instead of the 8 bytes
+// of a RefCountedVec<int> entry (value + refcount).
+struct PackedColumn {
+  PackedColumn(): reference(0), bits(0), count(0) {}
+
+  void build(const std::vector<int64_t> &values);
+
+  inline int64_t get(size_t i) const;
+
+  // batched random-access decode: out[j] = get(indices[j])
+  void gather(const int *indices, size_t n, int64_t *out) const;
+
+  size_t memory_bytes() const { return words.size() * sizeof(uint64_t); }
+
+  int64_t reference;
+  int bits;
+  size_t count;
+  std::vector<uint64_t> words;
+};
+
+// Frozen, read-only copy of a nanocube's summary table, stored as one
+// PackedColumn per measure of the summary type (see SummaryTraits).
+// Summary types that can't be split into integer columns (sketches,
+// floating point values) get the empty specialization below, whose
+// build() refuses to freeze.
+template <typename Summary, bool Columnar = SummaryTraits<Summary>::columnar>
+struct FrozenSummaries {
+  FrozenSummaries(): n(0) {}
+
+  // returns false if the summaries can't be frozen
+  bool build(const std::vector<Summary> &values);
+
+  size_t size() const { return n; }
+  Summary at(int i) const;
+
+  // batched decode of the summaries at the given indices
+  void gather(const int *indices, size_t count, Summary *out) const;
+
+  // sum of the summaries at the given indices
+  Summary sum(const int *indices, size_t count) const;
+
+  size_t memory_bytes() const;
+
+  std::vector<PackedColumn> columns;
+  size_t n;
+};
+
+template <typename Summary>
+struct FrozenSummaries<Summary, false> {
+  bool build(const std::vector<Summary> &) { return false; }
+  size_t size() const { return 0; }
+  Summary at(int) const { return Summary(); }
+  void gather(const int *, size_t, Summary *) const {}
+  Summary sum(const int *, size_t) const { return Summary(); }
+  size_t memory_bytes() const { return 0; }
+};
+
+#include "summary_store.inc"
@@ -0,0 +1,34 @@
+#pragma once
+
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <cstdint>
+#include <type_traits>
+
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+// Per-summary-type hooks used by the query code. The default works for
+// any type that nlohmann::json can convert to and from (int, double,
+// ...). Summary types that json doesn't know about specialize this
+// struct next to their definition (see sketches.h).
+//
+// Columnar summaries can be taken apart into n_columns integer
+// measures, which is what the frozen summary store (summary_store.h)
+// packs. By default only integral types are columnar.
+//
+// rank orders summaries for top-k queries, which prune with it: it must
+// not decrease as summaries are added together, so that the summary of
+// a subtree bounds the rank of any part of it.
+template <typename Summary>
+struct SummaryTraits {
+  static json to_json(const Summary &s) { return json(s); }
+  static Summary from_json(const json &j) { return j.get<Summary>(); }
+  static double rank(const Summary &s) { return (double) s; }
+
+  static const bool columnar = std::is_integral<Summary>::value;
+  static const int n_columns = 1;
+  static int64_t column(const Summary &s, int) { return (int64_t) s; }
+  static Summary from_columns(const int64_t *values) { return (Summary) values[0]; }
+};
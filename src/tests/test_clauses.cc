@@ -0,0 +1,517 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+#include "test_utils.h"
+#include "../polygon.h"
+#include "../quadtree.h"
+
+/******************************************************************************/
+
+// a random clause that doesn't key the result
+json unkeyed_clause(TestRNG &rng, int w)
+{
+  json c;
+  do {
+    c = random_clause(rng, w);
+  } while (c["operation"] == "split");
+  return c;
+}
+
+// clause on dim, and random unkeyed clauses on some of the others
+json query_with(TestRNG &rng, const vector<int> &schema, int dim,
+                const json &clause)
+{
+  json q = json::object();
+  for (size_t d = 0; d < schema.size(); ++d) {
+    if (random_below(rng, 2)) {
+      q[to_string(d)] = unkeyed_clause(rng, schema[d]);
+    }
+  }
+  q[to_string(dim)] = clause;
+  return q;
+}
+
+// the cells of a one-dimension split answer, by address
+std::map<int64_t, int> split_cells(const json &answer)
+{
+  std::map<int64_t, int> cells;
+  if (answer.is_object()) {
+    for (auto it = answer.begin(); it != answer.end(); ++it) {
+      cells[std::stoll(it.key())] = it.value();
+    }
+  }
+  return cells;
+}
+
+/******************************************************************************/
+// topk
+
+// the cells of a topk are cells of the split with the same prefix and
+// resolution, none of the others has a larger value, and there are k of
+// them unless the split has fewer
+void test_topk(const vector<int> &schema, int seed)
+{
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  for (int i = 0; i < 300; ++i) {
+    int dim = random_below(rng, schema.size());
+    int w = schema[dim];
+    int depth = random_below(rng, w + 1);
+    json split;
+    split["operation"] = "split";
+    split["prefix"] = address_json(random_below(rng, (int64_t) 1 << depth), depth);
+    split["resolution"] = (int) random_below(rng, w - depth + 1);
+    json q = query_with(rng, schema, dim, split);
+    std::map<int64_t, int> cells = split_cells(naive_answer(q, cubes.naive));
+
+    size_t k = 1 + random_below(rng, 8);
+    q[to_string(dim)]["operation"] = "topk";
+    q[to_string(dim)]["k"] = k;
+    QueryPlan plan;
+    QueryResult<int> result;
+    check(evaluate_query(q, cubes.nc, plan, result), "topk queries are valid", q);
+    check(result.size() == std::min(k, cells.size()),
+          "topk finds k cells, or all of them", {q, result.size()});
+    int smallest = INT32_MAX;
+    for (size_t r = 0; r < result.size(); ++r) {
+      int64_t address = result.key(r)[0];
+      check(cells.count(address) && cells[address] == result.value(r),
+            "topk cells are split cells", q);
+      smallest = std::min(smallest, result.value(r));
+      cells.erase(address);
+    }
+    for (auto it = cells.begin(); it != cells.end(); ++it) {
+      check(it->second <= smallest, "topk leaves out no larger cell", q);
+    }
+  }
+}
+
+void test_invalid_topk()
+{
+  QueryPlan plan;
+  json q;
+  q["0"]["operation"] = "topk";
+  q["0"]["prefix"] = address_json(0, 0);
+  q["0"]["resolution"] = 2;
+  q["0"]["k"] = 3;
+  check(compile_query(q, 2, plan), "topk clauses compile");
+  for (json k : {json(0), json(-2), json(2.5)}) {
+    q["0"]["k"] = k;
+    check(!compile_query(q, 2, plan), "topk needs an integer k of at least 1", k);
+  }
+  q["0"]["k"] = 3;
+  q["1"]["operation"] = "split";
+  q["1"]["prefix"] = address_json(0, 0);
+  q["1"]["resolution"] = 2;
+  check(!compile_query(q, 2, plan), "topk must be the only keyed clause");
+}
+
+/******************************************************************************/
+// adaptive split
+
+// the cells of an adaptive split stay within its budget, don't overlap,
+// come in address order, and each holds what a find of it does. With
+// no threshold and room enough they are the split's cells, and with
+// an unreachable one, the prefix's cell alone.
+void test_adaptive(const vector<int> &schema, int seed)
+{
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  for (int i = 0; i < 300; ++i) {
+    int dim = random_below(rng, schema.size());
+    int w = schema[dim];
+    int depth = random_below(rng, w + 1);
+    int64_t prefix = random_below(rng, (int64_t) 1 << depth);
+    json split;
+    split["operation"] = "split";
+    split["prefix"] = address_json(prefix, depth);
+    split["resolution"] = (int) random_below(rng, w - depth + 2);
+    json q = query_with(rng, schema, dim, split);
+    int target = std::min(depth + split["resolution"].get<int>(), w);
+    auto find = [&](int64_t address, int d) {
+      json f = q;
+      f[to_string(dim)] = {{"operation", "find"},
+                           {"prefix", address_json(address, d)}};
+      return NCQuery(f, cubes.nc).get<int>();
+    };
+
+    double threshold = random_below(rng, 2) ? 0 : random_below(rng, 200);
+    size_t max_cells = 1 + random_below(rng, 40);
+    std::vector<AdaptiveCell<int> > cells;
+    check(evaluate_adaptive_split(q, cubes.nc, threshold, max_cells, cells),
+          "adaptive splits are valid", q);
+    check(cells.size() <= max_cells, "adaptive splits keep to their budget",
+          {q, max_cells, adaptive_cells_to_json(cells)});
+    int64_t next = prefix << (target - depth), total = 0;
+    for (size_t c = 0; c < cells.size(); ++c) {
+      const AdaptiveCell<int> &cell = cells[c];
+      int shift = target - cell.depth;
+      check(cell.depth >= depth && cell.depth <= target &&
+            (cell.address >> (cell.depth - depth)) == prefix &&
+            (cell.address << shift) >= next,
+            "adaptive cells are disjoint cells of the prefix, in order",
+            {q, adaptive_cells_to_json(cells)});
+      next = (cell.address + 1) << shift;
+      check(cell.summary == find(cell.address, cell.depth),
+            "adaptive cells hold their finds", {q, c});
+      total += cell.summary;
+    }
+    check(total == find(prefix, depth), "adaptive cells cover their prefix", q);
+
+    evaluate_adaptive_split(q, cubes.nc, 0, 1 << w, cells);
+    std::map<int64_t, int> expected = split_cells(NCQuery(q, cubes.nc)), found;
+    for (size_t c = 0; c < cells.size(); ++c) {
+      check(cells[c].depth == target, "unbounded adaptive splits go all the way",
+            q);
+      found[cells[c].address] = cells[c].summary;
+    }
+    check(found == expected, "unbounded adaptive splits are splits", q);
+
+    evaluate_adaptive_split(q, cubes.nc, 1e18, 1 << w, cells);
+    check(cells.size() <= 1 && (cells.empty() || (cells[0].address == prefix &&
+                                                  cells[0].depth == depth)),
+          "adaptive splits stop at cells below the threshold", q);
+  }
+}
+
+void test_invalid_adaptive()
+{
+  TestCubes cubes({4, 4});
+  cubes.insert(1, {1, 2});
+  std::vector<AdaptiveCell<int> > cells;
+  json q;
+  q["0"]["operation"] = "find";
+  q["0"]["prefix"] = address_json(0, 0);
+  check(!evaluate_adaptive_split(q, cubes.nc, 0, 10, cells),
+        "adaptive splits need a split clause");
+  q["0"]["operation"] = "split";
+  q["0"]["resolution"] = 2;
+  q["1"] = q["0"];
+  check(!evaluate_adaptive_split(q, cubes.nc, 0, 10, cells),
+        "adaptive splits must be the only keyed clause");
+}
+
+/******************************************************************************/
+// bbox
+
+// whether the leaf at address (a quadtree of `levels` levels) is in the
+// bbox of clause: its cell at the bbox's level is, or, for levels past
+// the quadtree's, its whole span (or any of it, for partial overlaps)
+bool in_bbox(const json &clause, int levels, int64_t address, bool partial)
+{
+  int level = clause["level"];
+  int64_t x0 = clause["x0"], y0 = clause["y0"], x1 = clause["x1"], y1 = clause["y1"];
+  uint32_t x, y;
+  int drop = 0;
+  if (level <= levels) {
+    morton_decode(address >> 2 * (levels - level), x, y);
+  } else {
+    morton_decode(address, x, y);
+    drop = level - levels;
+  }
+  int64_t left = (int64_t) x << drop, right = ((int64_t) (x + 1) << drop) - 1;
+  int64_t bottom = (int64_t) y << drop, top = ((int64_t) (y + 1) << drop) - 1;
+  if (partial) {
+    return right >= x0 && left <= x1 && top >= y0 && bottom <= y1;
+  }
+  return left >= x0 && right <= x1 && bottom >= y0 && top <= y1;
+}
+
+// bboxes select the points of their cells, at the quadtree's levels and
+// past them
+void test_bbox(int levels, int seed)
+{
+  vector<int> schema = {2 * levels, 5};
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  for (int i = 0; i < 300; ++i) {
+    int level = random_below(rng, levels + 3);
+    int64_t side = (int64_t) 1 << level;
+    json clause;
+    clause["operation"] = "bbox";
+    clause["level"] = level;
+    int64_t x0 = random_below(rng, side), y0 = random_below(rng, side);
+    clause["x0"] = x0;
+    clause["y0"] = y0;
+    clause["x1"] = x0 + random_below(rng, side - x0);
+    clause["y1"] = y0 + random_below(rng, side - y0);
+    json q = query_with(rng, schema, 0, clause);
+    // partial overlaps would change ranges too
+    if (q.count("1") && q["1"]["operation"] == "range") {
+      q.erase("1");
+    }
+    json rest = q;
+    rest.erase("0");
+    for (int partial = 0; partial < 2; ++partial) {
+      json nc = NCQuery(q, cubes.nc, partial);
+      json naive = naive_answer_where(rest, cubes, [&](const vector<int64_t> &p) {
+        return in_bbox(clause, levels, p[0], partial);
+      });
+      check(normalize(nc) == naive, "bboxes select the points of their cells",
+            {q, partial, nc, naive});
+    }
+  }
+}
+
+// a tile's cells are those of the split below its prefix, laid out
+// row-major from the north-west corner, with y counted from the north
+void test_tiles(int seed)
+{
+  int levels = 10;
+  vector<int> schema = {2 * levels, 4};
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 3000);
+  size_t filled = 0;
+  for (int i = 0; i < 40; ++i) {
+    // shallow tiles off the corner, then any
+    int zoom = i < 20 ? 1 + i % 3 : random_below(rng, levels + 1);
+    int64_t n = (int64_t) 1 << zoom;
+    int64_t x = i < 20 ? 1 + random_below(rng, n - 1) : random_below(rng, n);
+    int64_t y = random_below(rng, n);
+    int cell_levels = std::min(levels - zoom, 8);
+    json q = json::object();
+    if (random_below(rng, 2)) {
+      q["1"] = unkeyed_clause(rng, schema[1]);
+    }
+    std::vector<int> cells;
+    int side;
+    check(NCTile(q, cubes.nc, 0, zoom, x, y, cells, side), "tiles are valid",
+          {zoom, x, y});
+    check(side == 1 << cell_levels && (int) cells.size() == side * side,
+          "tiles have side x side cells", {zoom, x, y});
+
+    // the same cells from a split, placed by their own coordinates
+    json split = q;
+    split["0"] = {{"operation", "split"},
+                  {"prefix", address_json(morton_encode(x, n - 1 - y), 2 * zoom)},
+                  {"resolution", 2 * cell_levels}};
+    QueryPlan plan;
+    QueryResult<int> result;
+    evaluate_query(split, cubes.nc, plan, result);
+    std::vector<int> expected((size_t) side * side, 0);
+    for (size_t r = 0; r < result.size(); ++r) {
+      uint32_t cx, cy;
+      morton_decode(result.key(r)[0], cx, cy);
+      check((cx >> cell_levels) == x && n - 1 - (cy >> cell_levels) == y,
+            "split cells lie in the tile", {zoom, x, y});
+      int64_t column = cx & (side - 1), row = side - 1 - (cy & (side - 1));
+      expected[row * side + column] = result.value(r);
+    }
+    filled += result.size();
+    check(cells == expected, "tiles hold the split's cells in row-major order",
+          {zoom, x, y});
+  }
+  check(filled > 0, "some tiles have cells");
+  std::vector<int> cells;
+  int side;
+  check(!NCTile(json::object(), cubes.nc, 0, 1, 2, 0, cells, side) &&
+        !NCTile(json::object(), cubes.nc, 0, levels + 1, 0, 0, cells, side),
+        "tiles outside the quadtree are invalid");
+}
+
+void test_invalid_bbox()
+{
+  QueryPlan plan;
+  json q;
+  q["0"] = {{"operation", "bbox"}, {"level", 31}, {"x0", 0}, {"y0", 0},
+            {"x1", 1}, {"y1", 1}};
+  check(compile_query(q, 1, plan), "bboxes up to level 31 compile");
+  q["0"]["level"] = 32;
+  check(!compile_query(q, 1, plan), "bboxes past level 31 don't compile");
+  q["0"]["level"] = -1;
+  check(!compile_query(q, 1, plan), "bboxes at negative levels don't compile");
+}
+
+/******************************************************************************/
+// in and ranges
+
+// a bound at a random depth
+json random_bound(TestRNG &rng, int w)
+{
+  int depth = random_below(rng, w + 1);
+  return address_json(random_below(rng, (int64_t) 1 << depth), depth);
+}
+
+// whether leaf v of a dimension of width w is in interval: as in the
+// descent, the leaf after it must not pass the upper bound, unless
+// partial overlaps count
+bool in_interval(const json &interval, int w, int64_t v, bool partial)
+{
+  int64_t lo = interval["lowerBound"]["address"];
+  int64_t up = interval["upperBound"]["address"];
+  int lo_shift = w - interval["lowerBound"]["depth"].get<int>();
+  int up_shift = w - interval["upperBound"]["depth"].get<int>();
+  return (v >> lo_shift) >= lo &&
+         ((partial ? v : v + 1) >> up_shift) <= up;
+}
+
+// a bound on dimension 0 at a random depth, half the time above one of
+// the points
+json cube_bound(TestRNG &rng, const TestCubes &cubes)
+{
+  int w = cubes.schema[0];
+  if (random_below(rng, 2)) {
+    return random_bound(rng, w);
+  }
+  int depth = random_below(rng, w + 1);
+  int64_t leaf = cubes.points[random_below(rng, cubes.points.size())][0];
+  return address_json(leaf >> (w - depth), depth);
+}
+
+// in clauses select the leaves below any of their prefixes, and ranges
+// clauses those in any of their intervals
+void test_in_and_ranges(int w, int seed)
+{
+  vector<int> schema = {w, 5};
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  for (int i = 0; i < 300; ++i) {
+    json clause;
+    int n = 1 + random_below(rng, 4);
+    if (i % 2) {
+      clause["operation"] = "in";
+      clause["prefixes"] = json::array();
+      for (int j = 0; j < n; ++j) {
+        clause["prefixes"].push_back(cube_bound(rng, cubes));
+      }
+    } else {
+      clause["operation"] = "ranges";
+      clause["intervals"] = json::array();
+      for (int j = 0; j < n; ++j) {
+        json interval;
+        interval["lowerBound"] = cube_bound(rng, cubes);
+        interval["upperBound"] = cube_bound(rng, cubes);
+        clause["intervals"].push_back(interval);
+      }
+    }
+    json q = query_with(rng, schema, 0, clause);
+    // partial overlaps would change ranges too
+    if (q.count("1") && q["1"]["operation"] == "range") {
+      q.erase("1");
+    }
+    json rest = q;
+    rest.erase("0");
+    for (int partial = 0; partial < 2; ++partial) {
+      json nc = NCQuery(q, cubes.nc, partial);
+      json naive = naive_answer_where(rest, cubes, [&](const vector<int64_t> &p) {
+        if (i % 2) {
+          for (const json &prefix : clause["prefixes"]) {
+            if (p[0] >> (w - prefix["depth"].get<int>()) == prefix["address"]) {
+              return true;
+            }
+          }
+          return false;
+        }
+        for (const json &interval : clause["intervals"]) {
+          if (in_interval(interval, w, p[0], partial)) {
+            return true;
+          }
+        }
+        return false;
+      });
+      check(normalize(nc) == naive, "in and ranges clauses select their leaves",
+            {q, partial, nc, naive});
+    }
+  }
+}
+
+void test_invalid_in_and_ranges()
+{
+  QueryPlan plan;
+  json in, ranges;
+  in["0"] = {{"operation", "in"}, {"prefixes", {address_json(1, 62)}}};
+  ranges["0"] = {{"operation", "ranges"},
+                 {"intervals", {{{"lowerBound", address_json(0, 0)},
+                                 {"upperBound", address_json(1, 62)}}}}};
+  check(compile_query(in, 1, plan) && compile_query(ranges, 1, plan),
+        "prefixes and bounds down to depth 62 compile");
+  for (int depth : {-1, 63}) {
+    in["0"]["prefixes"][0]["depth"] = depth;
+    ranges["0"]["intervals"][0]["upperBound"]["depth"] = depth;
+    check(!compile_query(in, 1, plan), "in prefixes past 0..62 don't compile",
+          depth);
+    check(!compile_query(ranges, 1, plan), "ranges bounds past 0..62 don't compile",
+          depth);
+  }
+}
+
+/******************************************************************************/
+// polygon
+
+// a rough disc around (lat, lon)
+Polygon disc(double lat, double lon, double radius, int n)
+{
+  Polygon polygon;
+  for (int i = 0; i < n; ++i) {
+    double a = 2 * M_PI * i / n;
+    polygon.push_back(std::make_pair(lat + radius * sin(a), lon + radius * cos(a)));
+  }
+  return polygon;
+}
+
+// covers larger than their bound are made at a coarser level, and
+// polygons aren't rasterized past the depth of their dimension
+void test_polygon_levels()
+{
+  Polygon polygon = disc(20, -40, 30, 40);
+  PrefixSet full, bounded;
+  check(polygon_cover(polygon, 10, full) == 10 && full.size() > 200,
+        "covers within their bound keep their level", (int) full.size());
+  int level = polygon_cover(polygon, 10, bounded, 200);
+  check(level < 10 && bounded.size() <= 200 && !bounded.empty(),
+        "covers past their bound are made coarser", {level, (int) bounded.size()});
+  for (size_t i = 0; i < bounded.size(); ++i) {
+    check(bounded[i].second <= 2 * level, "coarser covers stop at their level");
+  }
+
+  TestCubes cubes({8});
+  json q;
+  q["0"]["operation"] = "polygon";
+  q["0"]["level"] = 20;
+  q["0"]["points"] = json::array();
+  for (size_t i = 0; i < polygon.size(); ++i) {
+    q["0"]["points"].push_back({polygon[i].first, polygon[i].second});
+  }
+  QueryPlan plan;
+  check(compile_query(q, cubes.nc, plan) && plan.ops[0].level == 4,
+        "polygon levels are capped at their quadtree's depth", q);
+  for (size_t i = 0; i < plan.ops[0].prefixes->size(); ++i) {
+    check((*plan.ops[0].prefixes)[i].second <= 8,
+          "polygon covers stay within their dimension");
+  }
+  q["0"]["level"] = 32;
+  check(!compile_query(q, cubes.nc, plan), "polygons past level 31 don't compile");
+  q["0"]["level"] = -5;
+  check(!compile_query(q, cubes.nc, plan),
+        "polygons at negative levels don't compile");
+}
+
+/******************************************************************************/
+
+int main()
+{
+  test_topk({6, 4, 5}, 42);
+  test_topk({10}, 43);
+  test_invalid_topk();
+  test_adaptive({6, 4, 5}, 46);
+  test_adaptive({10}, 47);
+  test_invalid_adaptive();
+  test_bbox(4, 44);
+  // addresses past 32 bits
+  test_bbox(20, 48);
+  test_invalid_bbox();
+  test_tiles(53);
+  test_in_and_ranges(7, 45);
+  test_in_and_ranges(40, 49);
+  test_invalid_in_and_ranges();
+  test_polygon_levels();
+  cout << "clauses: OK" << endl;
+}
@@ -0,0 +1,68 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include "test_utils.h"
+
+/******************************************************************************/
+// a frozen nanocube answers every query like the live one it was
+// frozen from, and like naivecube
+
+void test_frozen_queries(const vector<int> &schema, int n_points, int seed)
+{
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, n_points);
+  Nanocube<int> frozen(cubes.nc);
+  check(frozen.freeze() && frozen.is_frozen(), "int nanocubes freeze");
+
+  for (int i = 0; i < 500; ++i) {
+    json q = random_query(rng, schema);
+    json live = NCQuery(q, cubes.nc), cold = NCQuery(q, frozen);
+    check(live == cold, "frozen nanocubes answer like live ones",
+          {q, live, cold});
+    json naive = naive_answer(q, cubes.naive);
+    check(normalize(cold) == naive, "frozen nanocubes answer like naivecube",
+          {q, cold, naive});
+  }
+}
+
+// large counts need wider columns
+void test_frozen_wide_values()
+{
+  vector<int> schema = {3, 3};
+  Nanocube<int> nc(schema);
+  TestRNG rng(2);
+  for (int i = 0; i < 200; ++i) {
+    nc.insert(1 << random_below(rng, 24), random_point(rng, schema));
+  }
+  Nanocube<int> frozen(nc);
+  check(frozen.freeze(), "int nanocubes freeze");
+  json q;
+  q["0"]["operation"] = "split";
+  q["0"]["prefix"] = address_json(0, 0);
+  q["0"]["resolution"] = 3;
+  q["1"]["operation"] = "split";
+  q["1"]["prefix"] = address_json(0, 0);
+  q["1"]["resolution"] = 3;
+  check(NCQuery(q, nc) == NCQuery(q, frozen),
+        "frozen nanocubes keep wide values");
+}
+
+void test_freeze_needs_columnar()
+{
+  Nanocube<double> nc({2});
+  nc.insert(0.5, {1});
+  check(!nc.freeze() && !nc.is_frozen(),
+        "nanocubes of non-columnar summaries don't freeze");
+}
+
+/******************************************************************************/
+
+int main()
+{
+  test_frozen_queries({6, 4, 5}, 3000, 27);
+  test_frozen_queries({2, 8}, 500, 28);
+  test_frozen_queries({10}, 2000, 29);
+  test_frozen_wide_values();
+  test_freeze_needs_columnar();
+  cout << "frozen: OK" << endl;
+}
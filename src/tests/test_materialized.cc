@@ -0,0 +1,127 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include "test_utils.h"
+#include "../materialized.h"
+
+/******************************************************************************/
+
+// a split of dim below a random prefix, with filters
+json pyramid_query(TestRNG &rng, const vector<int> &schema, int dim,
+                   const json &filters)
+{
+  json q = filters;
+  int depth = random_below(rng, schema[dim] + 1);
+  q[to_string(dim)]["operation"] = "split";
+  q[to_string(dim)]["prefix"] = address_json(random_below(rng, 1 << depth), depth);
+  q[to_string(dim)]["resolution"] = (int) random_below(rng, schema[dim] - depth + 2);
+  return q;
+}
+
+// the templates: splits of dim 0 with a find on dim 1, and of dim 2,
+// materialized 3 levels down
+json pyramid_templates(json &filters)
+{
+  filters["1"]["operation"] = "find";
+  filters["1"]["prefix"] = address_json(1, 1);
+  json first = filters, second = json::object();
+  first["0"] = {{"operation", "split"}, {"prefix", address_json(0, 0)},
+                {"resolution", 1}};
+  second["2"] = first["0"];
+  json templates = json::array();
+  templates.push_back({{"query", first}});
+  templates.push_back({{"query", second}, {"depth", 3}});
+  return templates;
+}
+
+// pyramids answer the splits they hold like the cube does, and leave
+// the others alone
+void check_pyramids(TestRNG &rng, const vector<int> &schema,
+                    const MaterializedPyramids<int> &pyramids,
+                    const Nanocube<int> &nc, const json &filters)
+{
+  for (int i = 0; i < 200; ++i) {
+    int dim = i % 2 ? 0 : 2;
+    json q = pyramid_query(rng, schema, dim, dim ? json::object() : filters);
+    QueryPlan plan;
+    check(compile_query(q, nc, plan), "pyramid queries compile", q);
+    QueryResult<int> materialized, walked(1);
+    execute_plan(plan, nc, walked);
+    const DimOp &op = plan.ops[dim];
+    int depth = std::min(op.prefix_depth + op.resolution, schema[dim]);
+    bool held = depth <= (dim ? 3 : schema[dim]);
+    check(pyramids.answer(plan, nc.version, materialized) == held,
+          "pyramids answer the splits down to their depth", q);
+    if (held) {
+      check(query_result_to_json(materialized) == query_result_to_json(walked),
+            "pyramids answer like the cube", q);
+    }
+  }
+  json q = pyramid_query(rng, schema, 0, json::object());
+  QueryPlan plan;
+  QueryResult<int> result;
+  compile_query(q, nc, plan);
+  check(!pyramids.answer(plan, nc.version, result),
+        "pyramids don't answer other filters", q);
+  compile_query(pyramid_query(rng, schema, 0, filters), nc, plan);
+  check(!pyramids.answer(plan, nc.version + 1, result),
+        "pyramids don't answer other versions");
+}
+
+// pyramids stay right as the cube grows, updated in place when the
+// inserts are touched and rebuilt when they aren't
+void test_pyramids(int seed)
+{
+  vector<int> schema = {6, 4, 5};
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  MaterializedPyramids<int> pyramids;
+  json filters;
+  check(pyramids.configure(pyramid_templates(filters), cubes.nc) &&
+        pyramids.size() == 2, "split templates configure");
+  pyramids.refresh(cubes.nc);
+  check_pyramids(rng, schema, pyramids, cubes.nc, filters);
+
+  // touched inserts that cancel out, on a cell few enough to update
+  vector<int64_t> point = random_point(rng, schema);
+  for (int i = 0; i < 3; ++i) {
+    cubes.insert(i ? -1 : 2, point);
+    pyramids.touch(point);
+  }
+  pyramids.refresh(cubes.nc);
+  check(pyramids.stats_json()["rebuilds"] == json(2),
+        "touched inserts update pyramids in place", pyramids.stats_json());
+  check_pyramids(rng, schema, pyramids, cubes.nc, filters);
+
+  cubes.insert(1, random_point(rng, schema));
+  pyramids.refresh(cubes.nc);
+  check(pyramids.stats_json()["rebuilds"] == json(4),
+        "untouched inserts rebuild pyramids", pyramids.stats_json());
+  check_pyramids(rng, schema, pyramids, cubes.nc, filters);
+}
+
+void test_invalid_templates()
+{
+  TestCubes cubes({4, 4});
+  MaterializedPyramids<int> pyramids;
+  json split = {{"operation", "split"}, {"prefix", address_json(0, 0)},
+                {"resolution", 1}};
+  json templates = json::array();
+  templates.push_back({{"query", {{"0", split}, {"1", split}}}});
+  check(!pyramids.configure(templates, cubes.nc),
+        "templates split a single dimension");
+  templates[0]["query"].erase("1");
+  templates[0]["depth"] = "deep";
+  check(!pyramids.configure(templates, cubes.nc), "template depths are integers");
+  check(!pyramids.configure(json::object(), cubes.nc), "templates come in arrays");
+  check(pyramids.size() == 0, "invalid templates configure nothing");
+}
+
+/******************************************************************************/
+
+int main()
+{
+  test_pyramids(49);
+  test_invalid_templates();
+  cout << "materialized: OK" << endl;
+}
@@ -0,0 +1,87 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include "test_utils.h"
+#include "../query_cost.h"
+
+/******************************************************************************/
+
+// the statistics count every node of every dimension once, at one
+// depth, and the trees of a dimension are those its nodes hang from
+void test_stats(const vector<int> &schema, int seed)
+{
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  NCStats stats;
+  stats.collect(cubes.nc);
+  check(stats.dims.size() == schema.size(), "stats have every dimension");
+  for (size_t d = 0; d < schema.size(); ++d) {
+    const NCStats::Dim &s = stats.dims[d];
+    const NCDim &dim = cubes.nc.dims[d];
+    size_t nodes = 0;
+    for (size_t i = 0; i < s.nodes_at_depth.size(); ++i) {
+      nodes += s.nodes_at_depth[i];
+    }
+    check(s.width == schema[d] && (int) s.nodes_at_depth.size() == schema[d] + 1,
+          "stats have a count per depth", (int) d);
+    check(nodes == dim.size() - dim.nodes.free_list.size(),
+          "node counts add up to the dimension's nodes", (int) d);
+    check(s.nodes_at_depth[0] == s.trees, "every tree has one root", (int) d);
+  }
+  check(stats.dims[0].trees == 1, "the first dimension is a single tree");
+}
+
+// estimates respect what the clauses can select at most
+void test_estimates(const vector<int> &schema, int seed)
+{
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  NCStats stats;
+  stats.collect(cubes.nc);
+  for (int i = 0; i < 300; ++i) {
+    json q = random_query(rng, schema);
+    if (i % 3 == 0) {
+      int w = schema[0];
+      int depth = random_below(rng, w + 1);
+      q["0"] = {{"operation", "topk"},
+                {"prefix", address_json(random_below(rng, 1 << depth), depth)},
+                {"resolution", (int) random_below(rng, w - depth + 2)},
+                {"k", 1 + (int) random_below(rng, 10)}};
+      for (size_t d = 1; d < schema.size(); ++d) {
+        if (q.count(to_string(d)) && q[to_string(d)]["operation"] == "split") {
+          q.erase(to_string(d));
+        }
+      }
+    }
+    QueryPlan plan;
+    check(compile_query(q, cubes.nc, plan), "random queries compile", q);
+    QueryCost cost = estimate_cost(plan, stats, random_below(rng, 2), 64);
+    check(cost.dims.size() == schema.size(), "costs have every dimension", q);
+    for (size_t d = 0; d < schema.size(); ++d) {
+      if (plan.ops[d].kind == OP_FIND) {
+        check(cost.dims[d].frontier_per_tree <= 1,
+              "finds select at most a node per tree", q);
+      }
+      check(cost.dims[d].frontier_per_tree <= cost.dims[d].visited_per_tree + 1e-9,
+            "clauses select nodes they visit", q);
+    }
+    if (plan.key_dims.empty()) {
+      check(cost.result_cells == 1, "unkeyed results have one cell", q);
+    } else if (plan.ops[plan.key_dims[0]].kind == OP_TOPK) {
+      check(cost.result_cells <= plan.ops[plan.key_dims[0]].k,
+            "topk results have at most k cells", q);
+    }
+    check(cost.total() >= 0, "costs aren't negative", q);
+  }
+}
+
+/******************************************************************************/
+
+int main()
+{
+  test_stats({6, 4, 5}, 50);
+  test_stats({2, 8}, 51);
+  test_estimates({6, 4, 5}, 52);
+  cout << "query_cost: OK" << endl;
+}
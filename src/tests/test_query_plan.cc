@@ -0,0 +1,330 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include "test_utils.h"
+
+/******************************************************************************/
+
+// a range clause with bounds at random depths
+json coarse_range(TestRNG &rng, int w)
+{
+  int lo_depth = random_below(rng, w + 1), up_depth = random_below(rng, w + 1);
+  int64_t lo = random_below(rng, (int64_t) 1 << lo_depth);
+  // an upper bound at or after the lower one
+  int64_t first_up = lo_depth > up_depth ?
+      lo >> (lo_depth - up_depth) : lo << (up_depth - lo_depth);
+  int64_t up = first_up + random_below(rng, ((int64_t) 1 << up_depth) - first_up);
+  json c;
+  c["operation"] = "range";
+  c["lowerBound"] = address_json(lo, lo_depth);
+  c["upperBound"] = address_json(up, up_depth);
+  return c;
+}
+
+// q with a coarse range on dim, and random clauses other than ranges
+// elsewhere
+json range_query(TestRNG &rng, const vector<int> &schema, int dim)
+{
+  json q = random_query(rng, schema);
+  for (size_t i = 0; i < schema.size(); ++i) {
+    if (q.count(to_string(i)) && q[to_string(i)]["operation"] == "range") {
+      q.erase(to_string(i));
+    }
+  }
+  q[to_string(dim)] = coarse_range(rng, schema[dim]);
+  return q;
+}
+
+// the same range on leaves: the nanocube leaves out the last leaf of
+// the upper bound's block unless partial overlaps count
+json leaf_range(const json &clause, int w, bool insert_partial_overlap)
+{
+  int lo_shift = w - clause["lowerBound"]["depth"].get<int>();
+  int up_shift = w - clause["upperBound"]["depth"].get<int>();
+  int64_t lo = clause["lowerBound"]["address"].get<int64_t>() << lo_shift;
+  int64_t up = (clause["upperBound"]["address"].get<int64_t>() + 1) << up_shift;
+  json c = clause;
+  c["lowerBound"] = address_json(lo, w);
+  c["upperBound"] = address_json(insert_partial_overlap ? up : up - 1, w);
+  return c;
+}
+
+/******************************************************************************/
+
+// compiled plans answer like naivecube, and query_json like NCQuery
+void test_plans(const vector<int> &schema, int seed)
+{
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  for (int i = 0; i < 500; ++i) {
+    json q = random_query(rng, schema);
+    json nc = NCQuery(q, cubes.nc), naive = naive_answer(q, cubes.naive);
+    check(normalize(nc) == naive, "queries answer like naivecube",
+          {q, nc, naive});
+    check(query_json(q, cubes.nc) == nc, "query_json answers like NCQuery", q);
+    QueryPlan plan;
+    check(compile_query(q, schema.size(), plan), "valid queries compile", q);
+  }
+}
+
+// memoized walks answer like plain ones
+void test_memoized(const vector<int> &schema, int seed)
+{
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  ExecutionOptions options;
+  options.memoize = true;
+  for (int i = 0; i < 500; ++i) {
+    json q = random_query(rng, schema);
+    QueryPlan plan;
+    check(compile_query(q, cubes.nc, plan), "random queries compile", q);
+    QueryResult<int> plain(plan.key_dims.size()), memoized(plan.key_dims.size());
+    execute_plan(plan, cubes.nc, plain);
+    execute_plan(plan, cubes.nc, memoized, options);
+    check(query_result_to_json(plain) == query_result_to_json(memoized),
+          "memoized walks answer like plain ones", q);
+  }
+}
+
+// insert_partial_overlap makes both bounds of a range inclusive, as in
+// naivecube; without it the upper bound's last leaf is left out
+void test_partial_overlap(const vector<int> &schema, int seed)
+{
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  for (int i = 0; i < 500; ++i) {
+    int dim = random_below(rng, schema.size());
+    json q = range_query(rng, schema, dim);
+    const json &clause = q[to_string(dim)];
+    for (int partial = 0; partial < 2; ++partial) {
+      json leaves = q;
+      leaves[to_string(dim)] = leaf_range(clause, schema[dim], partial);
+      json nc = NCQuery(q, cubes.nc, partial);
+      check(normalize(nc) == naive_answer(leaves, cubes.naive),
+            partial ? "partial overlap ranges are inclusive" :
+            "ranges leave out the upper bound's last leaf", {q, nc});
+    }
+    check(normalize(NCQuery(q, cubes.nc, true)) ==
+          normalize(NaiveCubeQuery(q, cubes.naive)),
+          "partial overlap ranges answer like naivecube", q);
+  }
+}
+
+// the sum of the summaries of a result
+int result_total(const QueryResult<int> &result)
+{
+  int total = 0;
+  for (size_t i = 0; i < result.size(); ++i) {
+    total += result.value(i);
+  }
+  return total;
+}
+
+// coarser plans round outwards, so with positive values their totals
+// never shrink, and coarsening by 0 changes nothing
+void test_coarsening(const vector<int> &schema, int seed)
+{
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  for (int i = 0; i < 300; ++i) {
+    int dim = random_below(rng, schema.size());
+    json q = random_below(rng, 2) ? range_query(rng, schema, dim) :
+        random_query(rng, schema);
+    QueryPlan plan;
+    check(compile_query(q, schema.size(), plan), "random queries compile", q);
+    int previous = 0;
+    for (int levels = 0; levels <= max_coarsening(plan); ++levels) {
+      QueryPlan coarse = coarsen_plan(plan, levels);
+      QueryResult<int> result(coarse.key_dims.size());
+      execute_plan(coarse, cubes.nc, result);
+      if (levels == 0) {
+        check(coarse.ops == plan.ops && !coarse.insert_partial_overlap,
+              "coarsening by 0 levels keeps the plan", q);
+      }
+      check(result_total(result) >= previous,
+            "coarser plans cover what finer ones do", {q, levels});
+      previous = result_total(result);
+    }
+  }
+}
+
+// progressive levels get finer, the last one is the exact answer, and
+// a budget needs no control
+void test_progressive(const vector<int> &schema, int seed)
+{
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  for (int i = 0; i < 100; ++i) {
+    json q = range_query(rng, schema, random_below(rng, schema.size()));
+    QueryPlan plan;
+    QueryResult<int> exact;
+    check(evaluate_query(q, cubes.nc, plan, exact), "random queries are valid", q);
+    vector<int> coarsenings;
+    json last;
+    int step = 1 + random_below(rng, 3);
+    check(evaluate_progressive<int>(
+              q, cubes.nc, step, 60000, 0,
+              [&](int coarsening, const QueryPlan &, const QueryResult<int> &result) {
+                check(coarsenings.empty() || coarsening < coarsenings.back(),
+                      "progressive levels get finer", q);
+                check(result_total(result) >= result_total(exact),
+                      "progressive levels cover the exact answer", q);
+                coarsenings.push_back(coarsening);
+                last = query_result_to_json(result);
+                return true;
+              }), "random queries are valid", q);
+    check(!coarsenings.empty() && coarsenings.back() == 0 &&
+          last == query_result_to_json(exact),
+          "the last progressive level is the exact answer", q);
+  }
+}
+
+// an expired or cancelled control stops the walks early, with what
+// they found so far, and only a deadline counts as a timeout
+void test_controls()
+{
+  vector<int> schema = {16, 12};
+  TestRNG rng(38);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 20000);
+  json q;
+  for (size_t d = 0; d < schema.size(); ++d) {
+    q[to_string(d)]["operation"] = "split";
+    q[to_string(d)]["prefix"] = address_json(0, 0);
+    q[to_string(d)]["resolution"] = schema[d];
+  }
+  // and a range of dimension 0 over the split of dimension 1
+  json range = q;
+  range["0"] = {{"operation", "range"}, {"lowerBound", address_json(1, 16)},
+                {"upperBound", address_json((1 << 16) - 1, 16)}};
+  vector<QueryNode> all_leaves;
+  query_split(cubes.nc, 0, cubes.nc.base_root, 0, 0, schema[0], all_leaves);
+
+  ThreadPool pool(2);
+  for (int expired = 0; expired < 2; ++expired) {
+    for (int i = 0; i < 4; ++i) {
+      int pooled = i % 2;
+      QueryPlan plan;
+      QueryResult<int> full;
+      check(evaluate_query(i < 2 ? q : range, cubes.nc, plan, full),
+            "splits and ranges are valid");
+      QueryControl control;
+      if (expired) {
+        control.set_timeout_ms(0);
+      } else {
+        control.cancel();
+      }
+      ExecutionOptions options;
+      options.control = &control;
+      options.pool = pooled ? &pool : 0;
+      options.parallel_threshold = 1;
+      QueryResult<int> partial(plan.key_dims.size());
+      execute_plan(plan, cubes.nc, partial, options);
+      check(partial.size() < full.size() && control.stopped() &&
+            control.timed_out == (bool) expired,
+            "stopped walks leave partial results", {expired, i});
+    }
+    QueryControl control;
+    if (expired) {
+      control.set_timeout_ms(0);
+    } else {
+      control.cancel();
+    }
+    vector<QueryNode> leaves;
+    query_split(cubes.nc, 0, cubes.nc.base_root, 0, 0, schema[0], leaves, &control);
+    check(leaves.size() < all_leaves.size() && control.timed_out == (bool) expired,
+          "stopped splits leave partial frontiers", expired);
+  }
+}
+
+// batches answer like their queries one at a time, ranges at coarse
+// depths and empty nanocubes included
+void test_batches(const vector<int> &schema, int seed)
+{
+  TestRNG rng(seed);
+  TestCubes cubes(schema), empty(schema);
+  fill_random(cubes, rng, 2000);
+  json queries = json::array();
+  for (int i = 0; i < 300; ++i) {
+    queries.push_back(i % 2 ? random_query(rng, schema) :
+                      range_query(rng, schema, random_below(rng, schema.size())));
+  }
+  for (int partial = 0; partial < 2; ++partial) {
+    json batch = NCQueryBatch(queries, cubes.nc, partial);
+    json none = NCQueryBatch(queries, empty.nc, partial);
+    for (size_t i = 0; i < queries.size(); ++i) {
+      check(batch[i] == NCQuery(queries[i], cubes.nc, partial),
+            "batched queries answer like single ones", {queries[i], partial});
+      check(none[i] == NCQuery(queries[i], empty.nc, partial),
+            "batches on empty nanocubes answer like single queries", queries[i]);
+    }
+  }
+}
+
+// batched lookups answer like the find queries of their cells, and
+// requests without a depth per dimension are malformed
+void test_lookup_batch(const vector<int> &schema, int seed)
+{
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  json request, finds = json::array();
+  request["depths"] = json::array();
+  for (size_t d = 0; d < schema.size(); ++d) {
+    request["depths"].push_back(random_below(rng, schema[d] + 2));
+  }
+  request["points"] = json::array();
+  for (int i = 0; i < 200; ++i) {
+    vector<int64_t> point = random_point(rng, schema);
+    json q = json::object();
+    for (size_t d = 0; d < schema.size(); ++d) {
+      int depth = std::min(request["depths"][d].get<int>(), schema[d]);
+      point[d] >>= schema[d] - depth;
+      q[to_string(d)]["operation"] = "find";
+      q[to_string(d)]["prefix"] = address_json(point[d], depth);
+    }
+    request["points"].push_back(point);
+    finds.push_back(NCQuery(q, cubes.nc));
+  }
+  json answers = NCLookupBatch(request, cubes.nc);
+  check(answers == finds, "batched lookups answer like finds", request);
+  request["depths"].erase(0);
+  check(NCLookupBatch(request, cubes.nc) == json::array(),
+        "lookups need a depth per dimension");
+}
+
+void test_invalid_queries()
+{
+  TestCubes cubes({3, 3});
+  cubes.insert(1, {1, 2});
+  QueryPlan plan;
+  json q;
+  q["0"]["operation"] = "bogus";
+  check(!compile_query(q, 2, plan), "unknown operations don't compile");
+  check(NCQuery(q, cubes.nc) == json(0), "invalid queries answer the empty summary");
+  q["0"]["operation"] = "find";
+  check(!compile_query(q, 2, plan), "find clauses need a prefix");
+}
+
+/******************************************************************************/
+
+int main()
+{
+  test_plans({6, 4, 5}, 28);
+  test_plans({1, 12}, 29);
+  test_memoized({6, 4, 5}, 36);
+  test_memoized({2, 3, 2, 4}, 37);
+  test_partial_overlap({6, 4, 5}, 30);
+  test_partial_overlap({9}, 31);
+  test_coarsening({6, 4, 5}, 32);
+  test_progressive({6, 4, 5}, 33);
+  test_batches({6, 4, 5}, 35);
+  test_controls();
+  test_lookup_batch({6, 4, 5}, 34);
+  test_invalid_queries();
+  cout << "query_plan: OK" << endl;
+}
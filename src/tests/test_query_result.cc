@@ -0,0 +1,294 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <map>
+#include <set>
+
+#include "test_utils.h"
+#include "../query_result.h"
+#include "../result_encoding.h"
+
+/******************************************************************************/
+// QueryResult against a std::map of the same keys
+
+void test_query_result(int key_size, int seed)
+{
+  TestRNG rng(seed);
+  QueryResult<int> result(key_size), other(key_size);
+  std::map<vector<int64_t>, int> expected;
+  for (int i = 0; i < 20000; ++i) {
+    vector<int64_t> key;
+    for (int j = 0; j < key_size; ++j) {
+      // a few large addresses, and many collisions
+      key.push_back(random_below(rng, 4) ? random_below(rng, 64) :
+                    random_below(rng, (int64_t) 1 << 40));
+    }
+    int value = 1 + random_below(rng, 5);
+    (i % 2 ? result : other).add(key.data(), value);
+    expected[key] += value;
+  }
+  result.merge(other);
+
+  check(result.size() == expected.size(), "results have one entry per key");
+  std::map<vector<int64_t>, int> found;
+  for (size_t i = 0; i < result.size(); ++i) {
+    vector<int64_t> key(result.key(i), result.key(i) + key_size);
+    check(!found.count(key), "result keys are distinct");
+    found[key] = result.value(i);
+  }
+  check(found == expected, "results sum the values added under each key");
+
+  result.clear();
+  check(result.empty() && result.size() == 0, "cleared results are empty");
+  int64_t key[3] = {1, 2, 3};
+  result.add(key, 7);
+  check(result.size() == 1 && result.at(key) == 7, "cleared results are reusable");
+}
+
+// a result with no keyed dimension is a single summary
+void test_single_summary()
+{
+  QueryResult<int> result;
+  result.add(0, 2);
+  result.add(0, 3);
+  check(result.size() == 1 && result.value(0) == 5,
+        "unkeyed results hold a single summary");
+}
+
+/******************************************************************************/
+// native results of multi-dimension splits, against naivecube
+
+// splits of some dimensions, random clauses on the others
+json split_query(TestRNG &rng, const vector<int> &schema)
+{
+  json q = json::object();
+  for (size_t d = 0; d < schema.size(); ++d) {
+    json c;
+    c["operation"] = "split";
+    c["prefix"] = address_json(0, 0);
+    c["resolution"] = (int) random_below(rng, schema[d] + 1);
+    q[to_string(d)] = random_below(rng, 3) ? c : random_clause(rng, schema[d]);
+  }
+  return q;
+}
+
+void test_split_results(int seed)
+{
+  vector<int> schema = {5, 3, 4};
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 3000);
+  for (int i = 0; i < 300; ++i) {
+    json q = split_query(rng, schema);
+    QueryPlan plan;
+    QueryResult<int> result;
+    check(evaluate_query(q, cubes.nc, plan, result), "split queries are valid", q);
+    check(result.key_size == (int) plan.key_dims.size(),
+          "results are keyed on the plan's keyed dimensions", q);
+    json nc = query_result_to_json(result), naive = naive_answer(q, cubes.naive);
+    check(normalize(nc) == naive, "split results answer like naivecube",
+          {q, nc, naive});
+  }
+}
+
+// the keys of a result
+std::set<vector<int64_t> > result_keys(const QueryResult<int> &result)
+{
+  std::set<vector<int64_t> > keys;
+  for (size_t i = 0; i < result.size(); ++i) {
+    keys.insert(vector<int64_t>(result.key(i), result.key(i) + result.key_size));
+  }
+  return keys;
+}
+
+// a cell is there when the walk reaches a summary, even one that adds
+// up to zero: +1 and -1 on the same points give the cells of +1 alone,
+// all zero, in every executor
+void test_zero_cells(int seed)
+{
+  vector<int> schema = {5, 4, 3};
+  TestRNG rng(seed);
+  TestCubes zeros(schema), ones(schema);
+  for (int i = 0; i < 500; ++i) {
+    vector<int64_t> point = random_point(rng, schema);
+    zeros.insert(1, point);
+    zeros.insert(-1, point);
+    ones.insert(1, point);
+  }
+  json queries = json::array();
+  for (int i = 0; i < 200; ++i) {
+    queries.push_back(split_query(rng, schema));
+  }
+  json batch = NCQueryBatch(queries, zeros.nc);
+  for (size_t i = 0; i < queries.size(); ++i) {
+    const json &q = queries[i];
+    QueryPlan plan;
+    QueryResult<int> zero, one;
+    evaluate_query(q, zeros.nc, plan, zero);
+    evaluate_query(q, ones.nc, plan, one);
+    check(result_keys(zero) == result_keys(one),
+          "cells adding up to zero are still cells", q);
+    check(batch[i] == query_result_to_json(zero),
+          "batched queries keep zero cells", {q, batch[i]});
+  }
+
+  json topk;
+  topk["0"]["operation"] = "topk";
+  topk["0"]["prefix"] = address_json(0, 0);
+  topk["0"]["resolution"] = schema[0];
+  topk["0"]["k"] = 5;
+  topk["1"]["operation"] = "find";
+  topk["1"]["prefix"] = address_json(1, 1);
+  QueryPlan plan;
+  QueryResult<int> zero, one;
+  evaluate_query(topk, zeros.nc, plan, zero);
+  evaluate_query(topk, ones.nc, plan, one);
+  check(zero.size() == one.size(), "topk keeps zero cells");
+
+  json split = topk;
+  split["0"]["operation"] = "split";
+  std::vector<AdaptiveCell<int> > zero_cells, one_cells;
+  evaluate_adaptive_split(split, zeros.nc, 0, 1000, zero_cells);
+  evaluate_adaptive_split(split, ones.nc, 0, 1000, one_cells);
+  check(zero_cells.size() == one_cells.size() && !one_cells.empty(),
+        "adaptive splits keep zero cells");
+}
+
+/******************************************************************************/
+// encoded results
+
+// the writers give the same bytes whatever their chunk size
+void test_chunked_encodings(int seed)
+{
+  vector<int> schema = {6, 5};
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 2000);
+  for (int i = 0; i < 100; ++i) {
+    json q = random_query(rng, schema);
+    QueryPlan plan;
+    QueryResult<int> result;
+    check(evaluate_query(q, cubes.nc, plan, result), "random queries are valid", q);
+    std::string whole, chunked;
+    check(encode_binary_result(result, plan, cubes.nc, whole),
+          "int results have a binary encoding", q);
+    BinaryResultWriter<int> binary(result, plan, cubes.nc, 7);
+    while (binary.next(chunked)) {}
+    check(chunked == whole, "chunked binary results are whole ones", q);
+
+    JsonResultWriter<int> text(result, 5);
+    chunked.clear();
+    while (text.next(chunked)) {}
+    check(chunked == query_result_to_json(result).dump(),
+          "chunked json results are query_result_to_json's", q);
+  }
+}
+
+// an empty split still has its columns, with no rows
+void test_empty_binary_result()
+{
+  TestCubes cubes({4, 4});
+  cubes.insert(1, {1, 2});
+  json q;
+  q["0"]["operation"] = "find";
+  q["0"]["prefix"] = address_json(3, 2);
+  q["1"]["operation"] = "split";
+  q["1"]["prefix"] = address_json(0, 0);
+  q["1"]["resolution"] = 4;
+  QueryPlan plan;
+  QueryResult<int> result;
+  std::string out;
+  check(evaluate_query(q, cubes.nc, plan, result) && result.empty() &&
+        encode_binary_result(result, plan, cubes.nc, out),
+        "empty split results have a binary encoding");
+  // header, then an address and a summary column of 9 bytes each
+  check(out.size() == 4 + 4 + 8 + 4 + 8 + 2 * 9,
+        "empty split results encode no rows", (int) out.size());
+}
+
+// the cells of a tensor, by key
+std::map<vector<int64_t>, int> tensor_cells(const json &tensor)
+{
+  std::map<vector<int64_t>, int> cells;
+  vector<int64_t> shape = tensor["shape"];
+  auto key_of = [&](uint64_t offset) {
+    vector<int64_t> key(shape.size());
+    for (int j = shape.size() - 1; j >= 0; --j) {
+      key[j] = tensor["axes"][j]["first"].get<int64_t>() + offset % shape[j];
+      offset /= shape[j];
+    }
+    return key;
+  };
+  const json &values = tensor["values"];
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (tensor["format"] == "dense" && values[i] != json(0)) {
+      cells[key_of(i)] = values[i];
+    } else if (tensor["format"] == "coo") {
+      cells[key_of(tensor["indices"][i])] = values[i];
+    }
+  }
+  return cells;
+}
+
+// tensors of splits and topks hold the cells of the result, in every
+// layout
+void test_tensor_results(int seed)
+{
+  vector<int> schema = {7, 5, 4};
+  TestRNG rng(seed);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 3000);
+  for (int i = 0; i < 200; ++i) {
+    json q = json::object();
+    for (size_t d = 0; d < schema.size(); ++d) {
+      if (random_below(rng, 3)) {
+        int depth = random_below(rng, schema[d] + 1);
+        q[to_string(d)]["operation"] = "split";
+        q[to_string(d)]["prefix"] = address_json(random_below(rng, 1 << depth), depth);
+        q[to_string(d)]["resolution"] = (int) random_below(rng, schema[d] - depth + 2);
+      }
+    }
+    if (i % 4 == 0) {
+      q = json::object();
+      q["0"]["operation"] = "topk";
+      q["0"]["prefix"] = address_json(random_below(rng, 4), 2);
+      q["0"]["resolution"] = 4;
+      q["0"]["k"] = 5;
+    }
+    QueryPlan plan;
+    QueryResult<int> result;
+    check(evaluate_query(q, cubes.nc, plan, result), "split queries are valid", q);
+    if (result.key_size == 0) {
+      continue;
+    }
+    std::map<vector<int64_t>, int> expected;
+    for (size_t r = 0; r < result.size(); ++r) {
+      expected[vector<int64_t>(result.key(r), result.key(r) + result.key_size)] =
+          result.value(r);
+    }
+    for (int layout = TENSOR_AUTO; layout <= TENSOR_COO; ++layout) {
+      std::string out;
+      check(write_tensor_result(result, plan, cubes.nc, [&out](std::string &chunk) {
+              out.append(chunk);
+              return true;
+            }, (TensorLayout) layout, 50), "keyed results have a tensor form", q);
+      json tensor = json::parse(out);
+      check(tensor_cells(tensor) == expected, "tensors hold the result's cells",
+            {q, tensor});
+    }
+  }
+}
+
+/******************************************************************************/
+
+int main()
+{
+  test_query_result(1, 29);
+  test_query_result(3, 30);
+  test_single_summary();
+  test_split_results(31);
+  test_zero_cells(34);
+  test_chunked_encodings(32);
+  test_empty_binary_result();
+  test_tensor_results(33);
+  cout << "query_result: OK" << endl;
+}
@@ -0,0 +1,53 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include "test_utils.h"
+#include "../result_cache.h"
+
+/******************************************************************************/
+
+void test_versions()
+{
+  ResultCache cache(1 << 20);
+  std::string response;
+  cache.put("q", 2, "two");
+  check(cache.get("q", 2, response) && response == "two",
+        "responses are cached for their version");
+
+  // a query that started before the cube changed
+  cache.put("old", 1, "one");
+  check(!cache.get("old", 1, response) && !cache.get("q", 1, response),
+        "older versions neither insert nor hit");
+  check(cache.get("q", 2, response) && cache.stats().invalidations == 0,
+        "older versions don't flush the cache");
+
+  check(!cache.get("q", 3, response), "newer versions miss");
+  cache.put("q", 2, "two");
+  check(cache.stats().entries == 0 && cache.stats().invalidations == 1,
+        "newer versions flush the cache, and older ones stay out");
+}
+
+void test_eviction()
+{
+  ResultCache cache(4096);
+  std::string response(1000, 'x');
+  for (int i = 0; i < 10; ++i) {
+    cache.put(to_string(i), 0, response);
+    // keep 0 the most recently used
+    check(cache.get("0", 0, response), "recently used responses stay");
+  }
+  ResultCache::Stats s = cache.stats();
+  check(s.bytes <= s.max_bytes && s.evictions > 0,
+        "the cache stays within its budget", s.bytes);
+  check(!cache.get("1", 0, response), "the least recently used go first");
+  cache.put("big", 0, std::string(5000, 'x'));
+  check(!cache.get("big", 0, response), "responses over budget aren't cached");
+}
+
+/******************************************************************************/
+
+int main()
+{
+  test_versions();
+  test_eviction();
+  cout << "result_cache: OK" << endl;
+}
@@ -0,0 +1,178 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <cmath>
+#include <set>
+
+#include "test_utils.h"
+#include "../sketches.h"
+
+/******************************************************************************/
+// HyperLogLog
+
+HyperLogLog hll_of(uint64_t first, uint64_t last)
+{
+  HyperLogLog result;
+  for (uint64_t i = first; i < last; ++i) {
+    result.add(i);
+  }
+  return result;
+}
+
+void test_hll_merge()
+{
+  HyperLogLog a = hll_of(0, 300), b = hll_of(200, 5000), c = hll_of(4000, 20000);
+  // merging takes register-wise maxima, so it is exactly associative
+  // and commutative, sparse and dense alike
+  HyperLogLog left = (a + b) + c, right = a + (b + c), swapped = c + (b + a);
+  check(left.estimate() == right.estimate() &&
+        left.n_registers() == right.n_registers(), "hll merge is associative");
+  check(left.estimate() == swapped.estimate(), "hll merge is commutative");
+  check((a + HyperLogLog()).estimate() == a.estimate(),
+        "the empty hll is the identity");
+
+  // the union estimates the distinct count, not the sum of the counts
+  double error = std::abs(left.estimate() - 20000) / 20000;
+  check(error < 0.05, "hll union is within 5% of the distinct count",
+        left.to_json()["estimate"]);
+  HyperLogLog small = hll_of(0, 100) + hll_of(50, 150);
+  check(std::abs(small.estimate() - 150) < 150 * 0.05,
+        "sparse hll union is within 5% of the distinct count");
+}
+
+void test_hll_json()
+{
+  check(HyperLogLog().to_json() == json({{"estimate", 0}}),
+        "the empty hll is {\"estimate\": 0}", HyperLogLog().to_json());
+  HyperLogLog sparse = hll_of(0, 10), dense = hll_of(0, 100000);
+  check(!sparse.is_dense() && sparse.to_json().count("sparse"),
+        "small hlls are sparse", sparse.to_json());
+  check(dense.is_dense() && dense.to_json().count("dense") &&
+        dense.to_json()["dense"].size() == HyperLogLog::N_REGISTERS,
+        "large hlls are dense");
+  check(HyperLogLog::from_json(sparse.to_json()) == sparse &&
+        HyperLogLog::from_json(dense.to_json()) == dense,
+        "hll json round-trips");
+}
+
+/******************************************************************************/
+// TDigest
+
+TDigest uniform_digest(TestRNG &rng, int n)
+{
+  TDigest result;
+  std::uniform_real_distribution<double> u(0, 1);
+  for (int i = 0; i < n; ++i) {
+    result.add(u(rng));
+  }
+  return result;
+}
+
+void test_tdigest_merge()
+{
+  TestRNG rng(26);
+  TDigest a = uniform_digest(rng, 1000), b = uniform_digest(rng, 5000),
+      c = uniform_digest(rng, 3000);
+  // compression depends on the merge order, so only the totals are
+  // exact; quantiles agree up to the sketch's error
+  TDigest left = (a + b) + c, right = a + (b + c);
+  check(left.count() == 9000 && right.count() == 9000 &&
+        left.min() == right.min() && left.max() == right.max(),
+        "tdigest merge keeps count, min and max");
+  double qs[] = {0.01, 0.1, 0.5, 0.9, 0.99};
+  for (double q: qs) {
+    check(std::abs(left.quantile(q) - right.quantile(q)) < 0.01,
+          "tdigest merge is associative up to its error");
+    check(std::abs(left.quantile(q) - q) < 0.02,
+          "tdigest union quantiles are within 0.02 of the truth");
+  }
+  check(left.n_centroids() <= 2 * TDigest::COMPRESSION + 10,
+        "merged tdigests stay compressed");
+  check((a + TDigest()) == a, "the empty tdigest is the identity");
+}
+
+void test_tdigest_json()
+{
+  check(TDigest().to_json() == json({{"count", 0}}),
+        "the empty tdigest is {\"count\": 0}", TDigest().to_json());
+  TestRNG rng(27);
+  TDigest t = uniform_digest(rng, 2000);
+  json j = t.to_json();
+  check(j["count"] == 2000 && j.count("min") && j.count("max") &&
+        j["quantiles"].count("0.5") && j["centroids"].is_array(),
+        "tdigest json has count, min, max, quantiles and centroids", j);
+  check(TDigest::from_json(j) == t, "tdigest json round-trips");
+}
+
+/******************************************************************************/
+// sketch results
+
+// summaries are json objects, which mustn't be mistaken for split
+// levels when merging results
+void test_merge_query_result()
+{
+  HyperLogLog a = hll_of(0, 1000), b = hll_of(500, 2000);
+  json merged = merge_query_result<HyperLogLog>(
+      json::array({a.to_json(), b.to_json()}));
+  check(HyperLogLog::from_json(merged) == a + b,
+        "merging hll results merges the sketches", merged);
+
+  json level_a, level_b;
+  level_a["3"] = a.to_json();
+  level_b["3"] = b.to_json();
+  level_b["4"] = b.to_json();
+  merged = merge_query_result<HyperLogLog>(json::array({level_a, level_b}));
+  check(merged.size() == 2 &&
+        HyperLogLog::from_json(merged["3"]) == a + b &&
+        HyperLogLog::from_json(merged["4"]) == b,
+        "merging split levels of hlls merges cell by cell", merged);
+}
+
+// a nanocube of sketches answers with the union of the sketches of the
+// points each cell holds
+void test_nanocube_of_sketches()
+{
+  TestRNG rng(28);
+  vector<int> schema = {4, 3};
+  Nanocube<HyperLogLog> nc(schema);
+  vector<std::set<uint64_t> > distinct(1 << schema[0]);
+  std::set<uint64_t> all;
+  for (int i = 0; i < 3000; ++i) {
+    vector<int64_t> point = random_point(rng, schema);
+    uint64_t item = random_below(rng, 500);
+    nc.insert(HyperLogLog(item), point);
+    distinct[point[0]].insert(item);
+    all.insert(item);
+  }
+
+  json total = query_json(json::object(), nc);
+  check(std::abs(total["estimate"].get<double>() - all.size()) < all.size() * 0.05,
+        "the root of a nanocube of hlls counts the distinct items", total);
+
+  json q;
+  q["0"]["operation"] = "split";
+  q["0"]["prefix"] = address_json(0, 0);
+  q["0"]["resolution"] = schema[0];
+  json split = query_json(q, nc);
+  for (size_t cell = 0; cell < distinct.size(); ++cell) {
+    if (distinct[cell].empty()) {
+      continue;
+    }
+    double estimate = split[to_string(cell)]["estimate"];
+    check(std::abs(estimate - distinct[cell].size()) < distinct[cell].size() * 0.05,
+          "split cells of a nanocube of hlls count their distinct items",
+          split[to_string(cell)]);
+  }
+}
+
+/******************************************************************************/
+
+int main()
+{
+  test_hll_merge();
+  test_hll_json();
+  test_tdigest_merge();
+  test_tdigest_json();
+  test_merge_query_result();
+  test_nanocube_of_sketches();
+  cout << "sketches: OK" << endl;
+}
@@ -0,0 +1,119 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <atomic>
+#include <future>
+#include <stdexcept>
+
+#include "test_utils.h"
+#include "../thread_pool.h"
+
+/******************************************************************************/
+
+// groups spawned from group tasks finish, and every task runs once
+void test_nested_groups()
+{
+  ThreadPool pool(3);
+  std::atomic<int> count(0);
+  TaskGroup outer(pool);
+  for (int i = 0; i < 20; ++i) {
+    outer.run([&pool, &count]() {
+      TaskGroup inner(pool);
+      for (int j = 0; j < 50; ++j) {
+        inner.run([&count]() { ++count; });
+      }
+      inner.wait();
+    });
+  }
+  outer.wait();
+  check(count.load() == 1000, "nested groups run every task once");
+}
+
+void test_exceptions()
+{
+  ThreadPool pool(2);
+  TaskGroup group(pool);
+  std::atomic<int> count(0);
+  for (int i = 0; i < 10; ++i) {
+    group.run([i, &count]() {
+      ++count;
+      if (i == 3) {
+        throw std::runtime_error("task 3");
+      }
+    });
+  }
+  bool thrown = false;
+  try {
+    group.wait();
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  check(thrown && count.load() == 10,
+        "wait rethrows a task's exception after every task ran");
+}
+
+// a thread waiting on a group doesn't pick up unrelated posted work:
+// with the only worker busy, the group still finishes (run by the
+// waiting thread) while the posted task stays queued
+void test_wait_only_helps_its_group()
+{
+  ThreadPool pool(1);
+  std::promise<void> release;
+  std::shared_future<void> released(release.get_future());
+  std::atomic<bool> blocked(false), posted_ran(false);
+  pool.post([released, &blocked]() {
+    blocked = true;
+    released.wait();
+  });
+  while (!blocked.load()) {
+    std::this_thread::yield();
+  }
+  pool.post([&posted_ran]() { posted_ran = true; });
+
+  std::atomic<int> count(0);
+  TaskGroup group(pool);
+  for (int i = 0; i < 10; ++i) {
+    group.run([&count]() { ++count; });
+  }
+  group.wait();
+  check(count.load() == 10, "the waiting thread runs its group's tasks");
+  check(!posted_ran.load(), "the waiting thread leaves posted tasks alone");
+
+  release.set_value();
+  while (!posted_ran.load()) {
+    std::this_thread::yield();
+  }
+}
+
+// queries spread over the pool answer like single-threaded ones
+void test_parallel_queries()
+{
+  vector<int> schema = {8, 6, 4};
+  TestRNG rng(32);
+  TestCubes cubes(schema);
+  fill_random(cubes, rng, 5000);
+  ThreadPool pool(4);
+  for (int i = 0; i < 300; ++i) {
+    json q = random_query(rng, schema);
+    QueryPlan plan;
+    check(compile_query(q, schema.size(), plan), "random queries compile", q);
+    QueryResult<int> serial(plan.key_dims.size()), parallel(plan.key_dims.size());
+    execute_plan(plan, cubes.nc, serial);
+    ExecutionOptions options;
+    options.pool = &pool;
+    options.parallel_threshold = 1;
+    execute_plan(plan, cubes.nc, parallel, options);
+    check(query_result_to_json(serial) == query_result_to_json(parallel),
+          "parallel queries answer like serial ones", q);
+  }
+}
+
+/******************************************************************************/
+
+int main()
+{
+  test_nested_groups();
+  test_exceptions();
+  test_wait_only_helps_its_group();
+  test_parallel_queries();
+  cout << "thread_pool: OK" << endl;
+}
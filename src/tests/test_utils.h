@@ -0,0 +1,188 @@
+#pragma once
+
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../json.hpp"
+#include "../nanocube.h"
+#include "../nanocube_traversals.h"
+#include "../naivecube.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+// Helpers shared by the property tests: random data, random queries,
+// and the comparison of nanocube results against naivecube. Every
+// test seeds its own generator, so failures reproduce.
+
+/******************************************************************************/
+
+typedef std::mt19937 TestRNG;
+
+inline void check(bool ok, const string &property, const json &detail = json())
+{
+  if (!ok) {
+    cerr << "FAILED PROPERTY: " << property << endl;
+    if (!detail.is_null()) {
+      cerr << detail.dump() << endl;
+    }
+    exit(1);
+  }
+}
+
+inline int64_t random_below(TestRNG &rng, int64_t n)
+{
+  return std::uniform_int_distribution<int64_t>(0, n - 1)(rng);
+}
+
+inline vector<int64_t> random_point(TestRNG &rng, const vector<int> &schema)
+{
+  vector<int64_t> result;
+  for (size_t i = 0; i < schema.size(); ++i) {
+    result.push_back(random_below(rng, (int64_t) 1 << schema[i]));
+  }
+  return result;
+}
+
+// a nanocube and a naivecube of the same random points, with counts
+// from 1 to 3
+struct TestCubes {
+  explicit TestCubes(const vector<int> &s): schema(s), nc(s), naive(s) {}
+
+  void insert(int value, const vector<int64_t> &point)
+  {
+    nc.insert(value, point);
+    naive.insert(value, point);
+    points.push_back(point);
+    values.push_back(value);
+  }
+
+  vector<int> schema;
+  Nanocube<int> nc;
+  Naivecube<int> naive;
+  vector<vector<int64_t> > points;
+  vector<int> values;
+};
+
+inline void fill_random(TestCubes &cubes, TestRNG &rng, int n_points)
+{
+  for (int i = 0; i < n_points; ++i) {
+    cubes.insert(1 + random_below(rng, 3), random_point(rng, cubes.schema));
+  }
+}
+
+/******************************************************************************/
+// random queries
+
+inline json address_json(int64_t address, int depth)
+{
+  json j;
+  j["address"] = address;
+  j["depth"] = depth;
+  return j;
+}
+
+// a find, split, range or all clause on a dimension of width w. Ranges
+// are on leaves (see naive_query).
+inline json random_clause(TestRNG &rng, int w)
+{
+  json c;
+  int depth = random_below(rng, w + 1);
+  switch (random_below(rng, 4)) {
+  case 0:
+    c["operation"] = "find";
+    c["prefix"] = address_json(random_below(rng, (int64_t) 1 << depth), depth);
+    break;
+  case 1:
+    c["operation"] = "split";
+    c["prefix"] = address_json(random_below(rng, (int64_t) 1 << depth), depth);
+    c["resolution"] = (int) random_below(rng, w - depth + 1);
+    break;
+  case 2: {
+    int64_t lo = random_below(rng, (int64_t) 1 << w);
+    int64_t up = lo + 1 + random_below(rng, ((int64_t) 1 << w) - lo);
+    c["operation"] = "range";
+    c["lowerBound"] = address_json(lo, w);
+    c["upperBound"] = address_json(up, w);
+    break;
+  }
+  default:
+    c["operation"] = "all";
+  }
+  return c;
+}
+
+// clauses on a random subset of the dimensions
+inline json random_query(TestRNG &rng, const vector<int> &schema)
+{
+  json q = json::object();
+  for (size_t i = 0; i < schema.size(); ++i) {
+    if (random_below(rng, 3)) {
+      q[to_string(i)] = random_clause(rng, schema[i]);
+    }
+  }
+  return q;
+}
+
+/******************************************************************************/
+// naivecube reference
+
+// the upper bound of a nanocube range excludes the leaf it names,
+// naivecube's includes it
+inline json naive_query(const json &q)
+{
+  json result = q;
+  for (auto it = result.begin(); it != result.end(); ++it) {
+    json &clause = it.value();
+    if (clause.is_object() && clause.count("operation") &&
+        clause["operation"] == "range") {
+      int64_t up = clause["upperBound"]["address"];
+      clause["upperBound"]["address"] = up - 1;
+    }
+  }
+  return result;
+}
+
+// naivecube answers null where a nanocube answers the empty summary,
+// and never has empty split levels
+inline json normalize(const json &j)
+{
+  if (j.is_null()) {
+    return 0;
+  }
+  if (!j.is_object()) {
+    return j;
+  }
+  json result = json::object();
+  for (auto it = j.begin(); it != j.end(); ++it) {
+    json v = normalize(it.value());
+    if (!(v.is_number() && v.get<int>() == 0)) {
+      result[it.key()] = v;
+    }
+  }
+  return result.empty() ? json(0) : result;
+}
+
+inline json naive_answer(const json &q, const Naivecube<int> &naive)
+{
+  return normalize(NaiveCubeQuery(naive_query(q), naive));
+}
+
+// the naivecube answer to q over the points for which keep is true
+template <typename Predicate>
+json naive_answer_where(const json &q, const TestCubes &cubes, Predicate keep)
+{
+  Naivecube<int> naive(cubes.schema);
+  for (size_t i = 0; i < cubes.points.size(); ++i) {
+    if (keep(cubes.points[i])) {
+      naive.insert(cubes.values[i], cubes.points[i]);
+    }
+  }
+  return naive_answer(q, naive);
+}
@@ -0,0 +1,203 @@
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include "thread_pool.h"
+
+#include <chrono>
+
+using namespace std;
+
+namespace {
+
+// the pool the calling thread works for, and its index there
+thread_local const ThreadPool *worker_pool = 0;
+thread_local int worker_index = -1;
+
+};
+
+/******************************************************************************/
+// TaskGroup
+
+TaskGroup::TaskGroup(ThreadPool &pool): pool_(pool), pending_(0), queued_(0) {}
+
+TaskGroup::~TaskGroup()
+{
+  // never leave tasks behind that point to a dead group
+  help();
+}
+
+void TaskGroup::run(const function<void()> &task)
+{
+  ++pending_;
+  ++queued_;
+  ThreadPool::Task t = { task, this };
+  pool_.submit(t);
+  lock_guard<mutex> lock(mutex_);
+  changed_.notify_all();
+}
+
+void TaskGroup::help()
+{
+  int self = pool_.current_worker();
+  unique_lock<mutex> lock(mutex_);
+  // the last task to finish decrements pending_ under mutex_, so once
+  // we see it at 0 here, no task touches the group anymore
+  while (pending_.load() > 0) {
+    if (queued_.load() > 0) {
+      lock.unlock();
+      pool_.try_run_one(self, this);
+      lock.lock();
+    } else {
+      changed_.wait(lock, [this]() {
+        return pending_.load() == 0 || queued_.load() > 0;
+      });
+    }
+  }
+}
+
+void TaskGroup::wait()
+{
+  help();
+  exception_ptr error;
+  {
+    lock_guard<mutex> lock(mutex_);
+    swap(error, error_);
+  }
+  if (error) {
+    rethrow_exception(error);
+  }
+}
+
+/******************************************************************************/
+// ThreadPool
+
+ThreadPool::ThreadPool(int n_threads):
+    queued_(0), next_queue_(0), stopping_(false)
+{
+  if (n_threads < 1) {
+    n_threads = 1;
+  }
+  for (int i=0; i<n_threads; ++i) {
+    queues_.push_back(unique_ptr<Queue>(new Queue()));
+  }
+  for (int i=0; i<n_threads; ++i) {
+    workers_.push_back(thread(&ThreadPool::worker_loop, this, i));
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  stopping_ = true;
+  {
+    lock_guard<mutex> lock(sleep_mutex_);
+    wake_.notify_all();
+  }
+  for (size_t i=0; i<workers_.size(); ++i) {
+    workers_[i].join();
+  }
+}
+
+void ThreadPool::post(const function<void()> &task)
+{
+  Task t = { task, 0 };
+  submit(t);
+}
+
+int ThreadPool::current_worker() const
+{
+  return worker_pool == this ? worker_index : -1;
+}
+
+void ThreadPool::submit(const Task &task)
+{
+  int self = current_worker();
+  size_t q = self != -1 ? self : (next_queue_++ % queues_.size());
+  {
+    lock_guard<mutex> lock(queues_[q]->mutex);
+    queues_[q]->tasks.push_back(task);
+  }
+  ++queued_;
+  lock_guard<mutex> lock(sleep_mutex_);
+  wake_.notify_one();
+}
+
+bool ThreadPool::take(Queue &q, bool back, TaskGroup *group, Task &task)
+{
+  lock_guard<mutex> lock(q.mutex);
+  if (q.tasks.empty()) {
+    return false;
+  }
+  if (!group) {
+    task = back ? q.tasks.back() : q.tasks.front();
+    if (back) {
+      q.tasks.pop_back();
+    } else {
+      q.tasks.pop_front();
+    }
+    if (task.group) {
+      --task.group->queued_;
+    }
+    return true;
+  }
+  size_t n = q.tasks.size();
+  for (size_t i=0; i<n; ++i) {
+    size_t j = back ? n - 1 - i : i;
+    if (q.tasks[j].group == group) {
+      task = q.tasks[j];
+      q.tasks.erase(q.tasks.begin() + j);
+      --group->queued_;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ThreadPool::try_run_one(int self, TaskGroup *group)
+{
+  if (queued_.load() == 0) {
+    return false;
+  }
+  Task task;
+  bool found = self != -1 && take(*queues_[self], true, group, task);
+  size_t n = queues_.size();
+  size_t start = self != -1 ? self + 1 : next_queue_.load();
+  for (size_t i=0; i<n && !found; ++i) {
+    found = take(*queues_[(start + i) % n], false, group, task);
+  }
+  if (!found) {
+    return false;
+  }
+  --queued_;
+
+  if (!task.group) {
+    task.fn();
+    return true;
+  }
+  exception_ptr error;
+  try {
+    task.fn();
+  } catch (...) {
+    error = current_exception();
+  }
+  lock_guard<mutex> lock(task.group->mutex_);
+  if (error && !task.group->error_) {
+    task.group->error_ = error;
+  }
+  if (--task.group->pending_ == 0) {
+    task.group->changed_.notify_all();
+  }
+  return true;
+}
+
+void ThreadPool::worker_loop(int self)
+{
+  worker_pool = this;
+  worker_index = self;
+  while (!stopping_.load()) {
+    if (!try_run_one(self)) {
+      unique_lock<mutex> lock(sleep_mutex_);
+      wake_.wait_for(lock, chrono::milliseconds(10), [this]() {
+        return stopping_.load() || queued_.load() > 0;
+      });
+    }
+  }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+// Copyright 2016 Arizona Board of Regents. See README.md and LICENSE for more.
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool;
+
+// A set of tasks that can be waited on together. wait() doesn't block
+// idly: the waiting thread runs the group's queued tasks itself, so
+// tasks can spawn and wait on groups of their own without starving the
+// pool. It only helps with its own group, never with unrelated work
+// (say a whole request post()ed to the pool) that could hold it up long
+// after the group is done; once none of the group's tasks are queued,
+// it sleeps until the running ones finish. The first exception thrown
+// by a task is rethrown by wait().
+class TaskGroup {
+ public:
+  explicit TaskGroup(ThreadPool &pool);
+  ~TaskGroup();
+
+  void run(const std::function<void()> &task);
+  void wait();
+
+ private:
+  friend class ThreadPool;
+
+  TaskGroup(const TaskGroup &);
+  TaskGroup &operator=(const TaskGroup &);
+
+  // runs the group's queued tasks until none is left pending
+  void help();
+
+  ThreadPool &pool_;
+  std::atomic<int> pending_; // submitted and not yet finished
+  std::atomic<int> queued_;  // submitted and not yet started
+
+  // guards error_, and the last pending_ decrement (see help())
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::exception_ptr error_;
+};
+
+// Work-stealing thread pool. Every worker owns a deque of tasks: it
+// pushes and pops its own tasks at the back, and when it runs dry it
+// steals from the front of the other workers' deques. Tasks submitted
+// from outside the pool are dealt to the workers round-robin.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int n_threads);
+  ~ThreadPool();
+
+  int size() const { return workers_.size(); }
+
+  // runs task on some worker, fire-and-forget. An exception escaping
+  // task terminates the program, as it would on a plain std::thread.
+  void post(const std::function<void()> &task);
+
+ private:
+  friend class TaskGroup;
+
+  struct Task {
+    std::function<void()> fn;
+    TaskGroup *group; // null for post()ed tasks
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  ThreadPool(const ThreadPool &);
+  ThreadPool &operator=(const ThreadPool &);
+
+  void submit(const Task &task);
+
+  // runs one queued task, if there is any, or only a task of group
+  // when it isn't null. self is the index of the calling worker, or -1
+  // for threads outside the pool.
+  bool try_run_one(int self, TaskGroup *group = 0);
+
+  // takes a task off q, from the back or the front, of group if not null
+  static bool take(Queue &q, bool back, TaskGroup *group, Task &task);
+
+  // worker index of the calling thread in this pool, or -1
+  int current_worker() const;
+
+  void worker_loop(int self);
+
+  std::vector<std::unique_ptr<Queue> > queues_;
+  std::vector<std::thread> workers_;
+
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  std::atomic<int> queued_;
+  std::atomic<unsigned> next_queue_;
+  std::atomic<bool> stopping_;
+};